@@ -5,6 +5,7 @@
 #define	LOADSIGNATURES_H
 
 #include "lmw/StdIncludes.h"
+#include "lmw/SignatureMatrix.h"
 
 void genData(vector<SVector<bool>*> &vectors, size_t sigSize, size_t numVectors) {
 
@@ -59,6 +60,53 @@ void readSignatures(vector<SVector<bool>*> &vectors, string docidFile, string si
     delete[] data;
 }
 
+/**
+ * Reads signatures straight into a contiguous SignatureMatrix rather than
+ * allocating a vector per signature. The caller owns the returned matrix.
+ */
+SignatureMatrix* readSignatures(string docidFile, string signatureFile,
+        size_t sigSize, size_t maxVectors) {
+    using namespace std;
+    cout << docidFile << endl << signatureFile << endl;
+
+    // setup streams
+    const size_t numBytes = sigSize / 8;
+    ifstream docidStream(docidFile);
+    ifstream sigStream(signatureFile, ios::in | ios::binary);
+    if (!docidStream || !sigStream) {
+        cout << "unable to open file" << endl;
+        return new SignatureMatrix(0, sigSize);
+    }
+
+    // size the matrix from the length of the signature file
+    sigStream.seekg(0, ios::end);
+    size_t capacity = size_t(sigStream.tellg()) / numBytes;
+    sigStream.seekg(0, ios::beg);
+    if (maxVectors != -1 && maxVectors < capacity) {
+        capacity = maxVectors;
+    }
+    SignatureMatrix* matrix = new SignatureMatrix(capacity, sigSize);
+
+    // read data directly into the rows of the matrix
+    string docid;
+    while (matrix->size() < capacity && getline(docidStream, docid)) {
+        SVector<bool>* vector = matrix->add();
+        if (!sigStream.read(reinterpret_cast<char*>(vector->getData()), numBytes)) {
+            matrix->removeLast();
+            break;
+        }
+        vector->setID(docid);
+        if (matrix->size() % 1000 == 0) {
+            cout << "." << flush;
+        }
+        if (matrix->size() % 100000 == 0) {
+            cout << matrix->size() << flush;
+        }
+    }
+    cout << endl << matrix->size() << endl;
+    return matrix;
+}
+
 void loadWikiSignatures(vector<SVector<bool>*>& vectors, int veccount) {
     const char docidFile[] = "data/wiki.4096.docids";
     const char signatureFile[] = "data/wiki.4096.sig";
@@ -66,6 +114,13 @@ void loadWikiSignatures(vector<SVector<bool>*>& vectors, int veccount) {
     readSignatures(vectors, docidFile, signatureFile, signatureLength, veccount);
 }
 
+SignatureMatrix* loadWikiSignatures(int veccount) {
+    const char docidFile[] = "data/wiki.4096.docids";
+    const char signatureFile[] = "data/wiki.4096.sig";
+    const size_t signatureLength = 4096;
+    return readSignatures(docidFile, signatureFile, signatureLength, veccount);
+}
+
 void loadSubset(vector<SVector<bool>*>& vectors, vector<SVector<bool>*>& subset,
         string docidFile) {
     using namespace std;
@@ -84,8 +139,8 @@ void loadSubset(vector<SVector<bool>*>& vectors, vector<SVector<bool>*>& subset,
 }
 
 void testReadVectors() {
-    vector < SVector<bool>*> vectors;
-    loadWikiSignatures(vectors, 100 * 1000);
+    SignatureMatrix* signatures = loadWikiSignatures(100 * 1000);
+    delete signatures;
 }
 
 #endif	/* LOADSIGNATURES_H */
@@ -10,18 +10,43 @@
 int main(int argc, char** argv) {
     std::srand(std::time(0));
 
-    if (true) {
+    // sharded streaming EM-tree, see streamingEMTreeShard()
+    //      EMTree seed
+    //      EMTree shard idFile signatureFile partialFile
+    //      EMTree merge partialFile...
+    // streaming EM-tree of dense float vectors, see streamingEMTreeDense()
+    //      EMTree dense idFile vectorFile dimensions
+    // regression checks, see testStreamingEMTreeVisitPrune(),
+    // testStreamingEMTreeCheckpointVisit(), testKTreeBulkLoad(),
+    // testKTreeAddBatch() and testKMeansParallelSeeder()
+    //      EMTree test
+    if (argc == 2 && string(argv[1]) == "seed") {
+        streamingEMTreeSeed();
+    } else if (argc == 5 && string(argv[1]) == "shard") {
+        streamingEMTreeShard(argv[2], argv[3], argv[4]);
+    } else if (argc > 2 && string(argv[1]) == "merge") {
+        streamingEMTreeMerge(vector<string>(argv + 2, argv + argc));
+    } else if (argc == 2 && string(argv[1]) == "test") {
+        testStreamingEMTreeVisitPrune();
+        testStreamingEMTreeCheckpointVisit();
+        testKTreeBulkLoad();
+        testKTreeAddBatch();
+        testKMeansParallelSeeder();
+    } else if (argc == 5 && string(argv[1]) == "dense") {
+        streamingEMTreeDense(argv[2], argv[3], std::stoul(argv[4]));
+    } else if (true) {
         streamingEMTree();
     } else if (false) {
         clueweb();
     } else {
         // load data
-        vector < SVector<bool>*> vectors;
+        SignatureMatrix* signatures;
         int veccount = -1;
         {
             boost::timer::auto_cpu_timer load("loading signatures: %w seconds\n");
-            loadWikiSignatures(vectors, veccount);
+            signatures = loadWikiSignatures(veccount);
         }
+        vector < SVector<bool>*>& vectors = signatures->getVectors();
 
         // filter data to XML Mining subset
         vector < SVector<bool>*> subset;
@@ -45,9 +70,7 @@ int main(int argc, char** argv) {
             cout << "error - vectors or subset empty" << endl;
         }
 
-        for (auto v : vectors) {
-            delete v;
-        }
+        delete signatures;
     }
 
     return EXIT_SUCCESS;
@@ -4,14 +4,17 @@
 #include "lmw/Distance.h"
 #include "lmw/Prototype.h"
 #include "lmw/SVector.h"
+#include "lmw/SignatureMatrix.h"
 #include "lmw/Cluster.h"
 #include "lmw/Clusterer.h"
 #include "lmw/Seeder.h"
 #include "lmw/DSquaredSeeder.h"
+#include "lmw/KMeansParallelSeeder.h"
 #include "lmw/RandomSeeder.h"
 #include "lmw/VectorGenerator.h"
 #include "lmw/StdIncludes.h"
 #include "lmw/SVectorStream.h"
+#include "lmw/MappedSVectorStream.h"
 #include "lmw/Optimizer.h"
 
 #include "lmw/KMeans.h"
@@ -24,13 +27,23 @@ using namespace lmw;
 
 typedef SVector<bool> vecType;
 typedef RandomSeeder<vecType> RandomSeeder_t;
-typedef Optimizer<vecType, hammingDistance, Minimize, meanBitPrototype2> OPTIMIZER;
+typedef KMeansParallelSeeder<vecType, hammingDistance> KMeansParallelSeeder_t;
+typedef Optimizer<vecType, hammingDistance, Minimize, meanBitPrototypeBitSliced> OPTIMIZER;
 typedef KMeans<vecType, RandomSeeder_t, OPTIMIZER> KMeans_t;
+typedef KMeans<vecType, KMeansParallelSeeder_t, OPTIMIZER> KMeansParallel_t;
 typedef TSVQ<vecType, KMeans_t, hammingDistance> TSVQ_t;
 typedef KTree<vecType, KMeans_t, OPTIMIZER> KTree_t;
 typedef EMTree<vecType, KMeans_t, OPTIMIZER> EMTree_t;
-typedef SVector<uint32_t> ACCUMULATOR;
+typedef BitSlicedAccumulator ACCUMULATOR;
 typedef StreamingEMTree<vecType, ACCUMULATOR, OPTIMIZER> StreamingEMTree_t;
 
+// dense vectors, such as embeddings
+typedef SVector<float> denseVecType;
+typedef Optimizer<denseVecType, euclideanDistance<denseVecType>, Minimize,
+        meanPrototype<denseVecType> > DENSE_OPTIMIZER;
+typedef KMeans<denseVecType, RandomSeeder<denseVecType>, DENSE_OPTIMIZER> DenseKMeans_t;
+typedef TSVQ<denseVecType, DenseKMeans_t, euclideanDistance<denseVecType> > DenseTSVQ_t;
+typedef StreamingEMTree<denseVecType, SVector<double>, DENSE_OPTIMIZER> DenseStreamingEMTree_t;
+
 #endif	/* EXPERIMENTTYPEDEFS_H */
 
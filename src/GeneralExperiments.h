@@ -3,6 +3,7 @@
 
 #include "lmw/StdIncludes.h"
 #include "ExperimentTypedefs.h"
+#include "CreateSignatures.h"
 
 void sigKmeansCluster(vector<SVector<bool>*> &vectors, const string& clusterFile) {
     // Define the types we want to use
@@ -10,6 +11,7 @@ void sigKmeansCluster(vector<SVector<bool>*> &vectors, const string& clusterFile
     int maxiters = 10;
     KMeans_t clusterer(k);
     clusterer.setMaxIters(maxiters);
+    clusterer.setAccelerated(true);
     {
         boost::timer::auto_cpu_timer all;
         cout << "clustering " << vectors.size() << " vectors into " << k
@@ -146,10 +148,123 @@ void sigKTreeCluster(vector<SVector<bool>*> &vectors) {
     t.report();
 
     cout << "\n\n";
+}
+
+/**
+ * Checks the K-tree invariants of the nodes at one depth. Nodes hold at most
+ * order keys, internal nodes are only above the leaves and the leaves are all
+ * at the same depth.
+ */
+class KTreeInvariantChecker : public NodeVisitor<Node<SVector<bool> > > {
+public:
+    KTreeInvariantChecker(int order, bool leafLevel) : _order(order),
+            _leafLevel(leafLevel), _objCount(0) { }
+
+    void accept(Node<SVector<bool> >* node) {
+        if (node->size() > _order) {
+            throw runtime_error("K-tree node holds more than order keys");
+        }
+        if (node->isLeaf() != _leafLevel) {
+            throw runtime_error("K-tree leaves are not all at the same depth");
+        }
+        if (_leafLevel) {
+            _objCount += node->size();
+        }
+    }
+
+    uint64_t getObjCount() {
+        return _objCount;
+    }
+
+private:
+    int _order;
+    bool _leafLevel;
+    uint64_t _objCount;
+};
+
+void checkKTree(KTree_t& kt, int order, size_t objCount) {
+    int levels = kt.getLevelCount();
+    uint64_t leafObjCount = 0;
+    for (int depth = 1; depth <= levels; ++depth) {
+        KTreeInvariantChecker checker(order, depth == levels);
+        kt.visit(checker, depth);
+        leafObjCount += checker.getObjCount();
+    }
+    if (leafObjCount != objCount || kt.getObjCount() != objCount) {
+        throw runtime_error("K-tree does not count every object once");
+    }
+}
 
-    // Clean up data
+/**
+ * bulkLoad() builds a valid K-tree that add() can continue to grow.
+ */
+void testKTreeBulkLoad() {
+    const int order = 10;
+    vector<SVector<bool>*> vectors;
+    genData(vectors, 4096, 5000);
+    vector<SVector<bool>*> loaded(vectors.begin(), vectors.begin() + 4000);
+    vector<SVector<bool>*> added(vectors.begin() + 4000, vectors.end());
+    KTree_t kt(order, 2);
+    kt.bulkLoad(loaded);
+    checkKTree(kt, order, loaded.size());
+    kt.add(added);
+    checkKTree(kt, order, vectors.size());
+    cout << "K-tree bulk load then add: ok" << endl;
     Utils::purge(vectors);
+}
+
+/**
+ * Adding a batch at a time builds a valid K-tree.
+ */
+void testKTreeAddBatch() {
+    const int order = 10;
+    vector<SVector<bool>*> vectors;
+    genData(vectors, 4096, 5000);
+    KTree_t kt(order, 2);
+    kt.setBatchSize(500);
+    kt.add(vectors);
+    checkKTree(kt, order, vectors.size());
+    cout << "K-tree batch add: ok" << endl;
+    Utils::purge(vectors);
+}
+
+/**
+ * KMeansParallelSeeder chooses k distinct seeds that only depend on the random
+ * seed, and KMeans clusters with it as the SEEDER.
+ */
+void testKMeansParallelSeeder() {
+    const int k = 20;
+    vector<SVector<bool>*> vectors;
+    genData(vectors, 4096, 10000);
+
+    KMeansParallelSeeder_t first(42), second(42);
+    vector<SVector<bool>*> seeds, again;
+    first.seed(vectors, seeds, k);
+    second.seed(vectors, again, k);
+    if (seeds.size() != size_t(k) || again.size() != size_t(k)) {
+        throw runtime_error("k-means|| did not choose k seeds");
+    }
+    for (int i = 0; i < k; ++i) {
+        if (SVector<bool>::hammingDistance(*seeds[i], *again[i]) != 0) {
+            throw runtime_error("k-means|| seeds differ for the same random seed");
+        }
+        for (int j = 0; j < i; ++j) {
+            if (SVector<bool>::hammingDistance(*seeds[i], *seeds[j]) == 0) {
+                throw runtime_error("k-means|| chose a seed twice");
+            }
+        }
+    }
 
+    KMeansParallel_t kmeans(k);
+    kmeans.setMaxIters(2);
+    kmeans.setEnforceNumClusters(true);
+    if (kmeans.cluster(vectors).size() != size_t(k)) {
+        throw runtime_error("k-means seeded with k-means|| lost clusters");
+    }
+    cout << "k-means|| seeding: ok" << endl;
+    Utils::purge(seeds);
+    Utils::purge(again);
+    Utils::purge(vectors);
 }
 
 // returns top half of dimensions
@@ -452,11 +452,12 @@ void clueweb() {
     string signatureFile = "data/clueweb.4096.signatures";
     int dims = 4096;
     int veccount = -1;
-    vector < SVector<bool>*> vectors;
+    SignatureMatrix* signatures;
     {
         boost::timer::auto_cpu_timer load("loading document vectors %w seconds\n");
-        readSignatures(vectors, docidFile, signatureFile, dims, veccount);
+        signatures = readSignatures(docidFile, signatureFile, dims, veccount);
     }
+    vector < SVector<bool>*>& vectors = signatures->getVectors();
 
     // k-tree
     if (true) {
@@ -470,9 +471,12 @@ void clueweb() {
         KTree_t kt(m, maxiters);
         kt.setDelayedUpdates(true);
         kt.setUpdateDelay(1000);
-        for (size_t i = 0; i < vectors.size(); i++) {
-            kt.add(vectors[i]);
-            size_t next = i + 1;
+        kt.setBatchSize(1000);
+        vector<SVector<bool>*> batch;
+        for (size_t i = 0; i < vectors.size(); i += 10000) {
+            size_t next = std::min(vectors.size(), i + 10000);
+            batch.assign(vectors.begin() + i, vectors.begin() + next);
+            kt.add(batch);
             if (next % 1000000 == 0) {
                 cout << next << flush;
             }
@@ -612,6 +616,8 @@ void clueweb() {
         all.stop();
         cout << "all operations took " << all.elapsed().wall / 1e9 << " seconds" << endl;        
     }
+
+    delete signatures;
 }
 
 #endif	/* JOURNALPAPEREXPERIMENTS_H */
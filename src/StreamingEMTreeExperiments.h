@@ -9,14 +9,43 @@
 #include "tbb/task_scheduler_init.h"
 #include "lmw/StreamingEMTree.h"
 
-StreamingEMTree_t* streamingEMTreeInit() {
+// The tree with its statistics, written after each iteration
+const char streamingEMTreeFile[] = "wikipedia_streaming_emtree.bin";
+
+// Saved during and after each iteration, and read back on restart
+const char streamingEMTreeCheckpoint[] = "wikipedia_streaming_emtree.checkpoint";
+const size_t checkpointInterval = 10000000;
+
+// The most memory signatures being inserted may take
+const size_t pipelineMemoryBudget = size_t(1) << 30;
+
+template <typename STREAMING_EMTREE>
+void configurePipeline(STREAMING_EMTREE* emtree) {
+    emtree->setAdaptivePipeline(true);
+    emtree->setMemoryBudget(pipelineMemoryBudget);
+}
+
+StreamingEMTree_t* streamingEMTreeInit(size_t* streamOffset) {
+    *streamOffset = 0;
+
+    // continue from the checkpoint of an earlier run instead of seeding
+    if (std::ifstream(streamingEMTreeCheckpoint)) {
+        boost::timer::auto_cpu_timer load("restoring streaming EM-tree: %w seconds\n");
+        auto tree = new StreamingEMTree_t(streamingEMTreeCheckpoint, streamOffset);
+        cout << "restored streaming EM-tree from " << streamingEMTreeCheckpoint
+                << " after " << tree->getUpdateCount() << " updates and "
+                << *streamOffset << " vectors" << endl;
+        return tree;
+    }
+
     // load data
-    vector < SVector<bool>*> vectors;
+    SignatureMatrix* signatures;
     int veccount = -1;
     {
         boost::timer::auto_cpu_timer load("loading signatures: %w seconds\n");
-        loadWikiSignatures(vectors, veccount);
+        signatures = loadWikiSignatures(veccount);
     }
+    vector < SVector<bool>*>& vectors = signatures->getVectors();
 
     // filter data to XML Mining subset
     vector < SVector<bool>*> subset;
@@ -40,9 +69,7 @@ StreamingEMTree_t* streamingEMTreeInit() {
     cout << "TSVQ iterations = " << maxiter << endl;
     auto tree = new StreamingEMTree_t(tsvq.getMWayTree());
 
-    for (auto v : vectors) {
-        delete v;
-    }
+    delete signatures;
 
     return tree;
 }
@@ -52,7 +79,8 @@ const char wikiSignatureFile[] = "data/wiki.4096.sig";
 const size_t wikiSignatureLength = 4096;
     
 
-void report(StreamingEMTree_t* emtree) {
+template <typename STREAMING_EMTREE>
+void report(STREAMING_EMTREE* emtree) {
     int maxDepth = emtree->getMaxLevelCount();
     cout << "max depth = " << maxDepth << endl;
     for (int i = 0; i < maxDepth; i++) {
@@ -65,7 +93,7 @@ void report(StreamingEMTree_t* emtree) {
 
 void insertWriteClusters(StreamingEMTree_t* emtree) {
     // open files
-    SVectorStream<SVector<bool>> vs(wikiDocidFile, wikiSignatureFile, wikiSignatureLength);
+    MappedSVectorStream vs(wikiDocidFile, wikiSignatureFile, wikiSignatureLength);
 
     // setup output streams for all levels in the tree
     const string prefix = "wikipedia_clusters";
@@ -76,6 +104,7 @@ void insertWriteClusters(StreamingEMTree_t* emtree) {
         ClusterWriter cw(emtree->getMaxLevelCount(), prefix);
         emtree->visit(vs, cw);
     }
+    cout << emtree->getVectorsPerSecond() << " vectors/sec" << endl;
     
     // prune
     cout << emtree->prune() << " nodes pruned" << endl;
@@ -91,16 +120,19 @@ void insertWriteClusters(StreamingEMTree_t* emtree) {
     }    
 }
 
-void streamingEMTreeInsertPruneReport(StreamingEMTree_t* emtree) {
+void streamingEMTreeInsertPruneReport(StreamingEMTree_t* emtree, size_t streamOffset) {
     // open files
-    SVectorStream<SVector<bool>> vs(wikiDocidFile, wikiSignatureFile, wikiSignatureLength);
+    MappedSVectorStream vs(wikiDocidFile, wikiSignatureFile, wikiSignatureLength);
+    vs.skip(streamOffset);
     
     // insert from stream
     boost::timer::auto_cpu_timer insert("inserting into streaming EM-tree: %w seconds\n");
     insert.start();
-    size_t read = emtree->insert(vs);
+    size_t read = emtree->insert(vs, checkpointInterval, streamingEMTreeCheckpoint,
+            streamOffset);
     insert.stop();
     cout << read << " vectors streamed from disk" << endl;
+    cout << emtree->getVectorsPerSecond() << " vectors/sec" << endl;
     insert.report();
 
     // prune
@@ -123,15 +155,26 @@ void streamingEMTree() {
 
     // streaming EMTree
     const int maxIters = 2;
-    StreamingEMTree_t* emtree = streamingEMTreeInit();
+    size_t streamOffset;
+    StreamingEMTree_t* emtree = streamingEMTreeInit(&streamOffset);
+    configurePipeline(emtree);
     cout << endl << "Streaming EM-tree:" << endl;
-    for (int i = 0; i < maxIters - 1; i++) {
+    for (int i = emtree->getUpdateCount(); i < maxIters - 1; i++) {
         cout << "ITERATION " << i << endl;
-        streamingEMTreeInsertPruneReport(emtree);
+        streamingEMTreeInsertPruneReport(emtree, streamOffset);
+        streamOffset = 0;
+        {
+            boost::timer::auto_cpu_timer write("writing streaming EM-tree: %w seconds\n");
+            emtree->write(streamingEMTreeFile);
+        }
         {
             boost::timer::auto_cpu_timer update("update streaming EM-tree: %w seconds\n");
             emtree->update();
-        }        
+        }
+        {
+            boost::timer::auto_cpu_timer checkpoint("checkpointing streaming EM-tree: %w seconds\n");
+            emtree->checkpoint(streamingEMTreeCheckpoint, 0);
+        }
         cout << "-----" << endl << endl;
     }
     
@@ -139,5 +182,174 @@ void streamingEMTree() {
     insertWriteClusters(emtree);
 }
 
+/**
+ * Seeds the tree and checkpoints it for the first round of shards.
+ */
+void streamingEMTreeSeed() {
+    size_t streamOffset;
+    StreamingEMTree_t* emtree = streamingEMTreeInit(&streamOffset);
+    emtree->checkpoint(streamingEMTreeCheckpoint, streamOffset);
+    delete emtree;
+}
+
+/**
+ * Inserts one shard of the corpus into the tree in the checkpoint and saves
+ * the partial result. Shards can run in separate processes or on separate
+ * machines, as long as they start from the same checkpoint.
+ */
+void streamingEMTreeShard(const string& idFile, const string& signatureFile,
+        const string& partialFile) {
+    size_t streamOffset;
+    StreamingEMTree_t emtree(streamingEMTreeCheckpoint, &streamOffset);
+    configurePipeline(&emtree);
+    MappedSVectorStream vs(idFile, signatureFile, wikiSignatureLength);
+    {
+        boost::timer::auto_cpu_timer insert("inserting shard into streaming EM-tree: %w seconds\n");
+        cout << emtree.insert(vs) << " vectors streamed from " << signatureFile << endl;
+    }
+    cout << emtree.getVectorsPerSecond() << " vectors/sec" << endl;
+    emtree.exportAccumulators(partialFile);
+}
+
+/**
+ * Merges the partial results of all shards into the tree in the checkpoint,
+ * completes the iteration and checkpoints the updated tree for the next
+ * round of shards.
+ */
+void streamingEMTreeMerge(const vector<string>& partialFiles) {
+    size_t streamOffset;
+    StreamingEMTree_t emtree(streamingEMTreeCheckpoint, &streamOffset);
+    {
+        boost::timer::auto_cpu_timer merge("merging partial results: %w seconds\n");
+        for (const string& partialFile : partialFiles) {
+            emtree.mergeAccumulators(partialFile);
+        }
+    }
+    cout << emtree.prune() << " nodes pruned" << endl;
+    report(&emtree);
+    emtree.write(streamingEMTreeFile);
+    emtree.update();
+    emtree.checkpoint(streamingEMTreeCheckpoint, 0);
+}
+
+/**
+ * Clusters dense vectors, such as embeddings, with the mean as the cluster
+ * representative. The tree is seeded with TSVQ on the start of the stream.
+ */
+void streamingEMTreeDense(const string& idFile, const string& vectorFile,
+        size_t dimensions) {
+    // run TSVQ to build tree on sample
+    const size_t sampleSize = 100000;
+    const int m = 10;
+    const int depth = 4;
+    const int maxiter = 0;
+    DenseStreamingEMTree_t* emtree;
+    {
+        boost::timer::auto_cpu_timer seed("cluster sample using TSVQ: %w seconds\n");
+        SVectorStream<denseVecType> sampleStream(idFile, vectorFile, dimensions);
+        vector<denseVecType*> sample;
+        sampleStream.read(sampleSize, &sample);
+        DenseTSVQ_t tsvq(m, depth, maxiter);
+        tsvq.cluster(sample);
+        emtree = new DenseStreamingEMTree_t(tsvq.getMWayTree());
+        sampleStream.free(&sample);
+    }
+    configurePipeline(emtree);
+
+    const int maxIters = 2;
+    cout << endl << "Streaming EM-tree of dense vectors:" << endl;
+    for (int i = 0; i < maxIters; i++) {
+        cout << "ITERATION " << i << endl;
+        SVectorStream<denseVecType> vs(idFile, vectorFile, dimensions);
+        {
+            boost::timer::auto_cpu_timer insert("inserting into streaming EM-tree: %w seconds\n");
+            cout << emtree->insert(vs) << " vectors streamed from disk" << endl;
+        }
+        cout << emtree->getVectorsPerSecond() << " vectors/sec" << endl;
+        cout << emtree->prune() << " nodes pruned" << endl;
+        report(emtree);
+        if (i < maxIters - 1) {
+            boost::timer::auto_cpu_timer update("update streaming EM-tree: %w seconds\n");
+            emtree->update();
+        }
+        cout << "-----" << endl << endl;
+    }
+    delete emtree;
+}
+
+class NullVisitor : public InsertVisitor<SVector<bool> > {
+public:
+    void accept(int, SVector<bool>*, SVector<bool>*, double) { }
+};
+
+/**
+ * Visiting updates the object counts of the leaf clusters like inserting
+ * does, so pruning after a visit must remove the same clusters as pruning
+ * after an insert.
+ */
+void testStreamingEMTreeVisitPrune() {
+    vector<SVector<bool>*> vectors;
+    genData(vectors, 4096, 20000);
+    TSVQ_t tsvq(4, 3, 0);
+    tsvq.cluster(vectors);
+    StreamingEMTree_t inserted(tsvq.getMWayTree());
+    StreamingEMTree_t visited(tsvq.getMWayTree());
+
+    // aggregates of the empty trees are refreshed before streaming
+    inserted.getObjCount();
+    visited.getObjCount();
+    NullVisitor visitor;
+    inserted.insert(vectors);
+    visited.visit(vectors, visitor);
+
+    if (visited.getObjCount() != vectors.size()) {
+        throw runtime_error("visit did not update the object counts");
+    }
+    if (visited.prune() != inserted.prune()
+            || visited.getClusterCount(1) != inserted.getClusterCount(1)) {
+        throw runtime_error("prune after visit removed clusters with vectors");
+    }
+    cout << "visit then prune: ok" << endl;
+    Utils::purge(vectors);
+}
+
+/**
+ * The last iteration of streamingEMTree(), which visits and prunes the tree
+ * checkpointed after update(), whether it continues in the same process or
+ * is restored from the checkpoint.
+ */
+void testStreamingEMTreeCheckpointVisit() {
+    const string checkpointFile = "test_streaming_emtree.checkpoint";
+    vector<SVector<bool>*> vectors;
+    genData(vectors, 4096, 20000);
+    TSVQ_t tsvq(4, 3, 0);
+    tsvq.cluster(vectors);
+    StreamingEMTree_t emtree(tsvq.getMWayTree());
+    emtree.insert(vectors);
+    emtree.prune();
+    emtree.update();
+    emtree.checkpoint(checkpointFile, 0);
+
+    size_t streamOffset;
+    StreamingEMTree_t restored(checkpointFile, &streamOffset);
+    std::remove(checkpointFile.c_str());
+    NullVisitor visitor;
+    emtree.visit(vectors, visitor);
+    restored.visit(vectors, visitor);
+
+    if (emtree.getObjCount() != vectors.size()
+            || restored.getObjCount() != vectors.size()) {
+        throw runtime_error("visit after checkpoint did not update the object counts");
+    }
+    if (emtree.prune() != restored.prune()
+            || emtree.getClusterCount(1) == 0
+            || emtree.getClusterCount(1) != restored.getClusterCount(1)
+            || emtree.getRMSE() != restored.getRMSE()) {
+        throw runtime_error("restored tree differs after visit and prune");
+    }
+    cout << "checkpoint, visit then prune: ok" << endl;
+    Utils::purge(vectors);
+}
+
 #endif	/* STREAMINGEMTREEEXPERIMENTS_H */
 
@@ -40,6 +40,7 @@ struct HOptions {
 		eps = 0.00001f;
 		saStart = 0.2f;
 		saIters = 0;
+		minMoved = 0;
 	}
 
 	string vectorsFile;
@@ -53,6 +54,7 @@ struct HOptions {
 	float eps;
 	float saStart; // A probability parameter for simulated annealing
 	float saIters; // The number of simulated annealing iterations
+	float minMoved; // Converged when at most this fraction of vectors move
 
 };
 
@@ -1,25 +1,49 @@
 #ifndef H_PARALLEL
 #define H_PARALLEL
 
+#include <algorithm>
+#include <vector>
+
 #include "ThreadPool.h"
 
 // Parallel for
+// The indexes are processed in chunks of grainSize, which the pool's threads
+// split and steal between them.
 template<typename Func>
 void parallel_for(ThreadPool &pool, int first, int last, int grainSize, Func &f) {
+	if (last <= first) return;
+	int numChunks = (last - first + grainSize - 1) / grainSize;
+	auto chunk = [&](int c) {
+		int begin = first + c * grainSize;
+		int end = std::min(last, begin + grainSize);
+		for (int i = begin; i < end; i++) {
+			f(i);
+		}
+	};
+	pool.run(numChunks, chunk);
+}
+
 
-	std::vector< std::future<void> > results;
-	for (int it = first; it < last; it += grainSize) {
-		auto func = [=]() {
-			for (int i = it; i < last && i < (it + grainSize); i++) {
-				f(i);
-			}
-		};
-		results.push_back(pool.enqueue(func));
-	}
-	// Execute
-	for (size_t i = 0; i<results.size(); ++i) results[i].get();
-
-	//cout << pool.
+// Parallel reduce
+// f(begin, end) reduces the indexes in [begin, end) to a Value. Each chunk of
+// grainSize indexes is reduced by one call and the values are combined with +=
+// in order, so the result does not depend on the number of threads.
+template<typename Value, typename Func>
+Value parallel_reduce(ThreadPool &pool, int first, int last, int grainSize,
+		const Value &identity, Func &f) {
+	if (last <= first) return identity;
+	int numChunks = (last - first + grainSize - 1) / grainSize;
+	std::vector<Value> values(numChunks, identity);
+	auto chunk = [&](int c) {
+		int begin = first + c * grainSize;
+		values[c] = f(begin, std::min(last, begin + grainSize));
+	};
+	pool.run(numChunks, chunk);
+
+	// Combine
+	Value total = identity;
+	for (size_t i = 0; i<values.size(); ++i) total += values[i];
+	return total;
 }
 
 
@@ -60,6 +60,14 @@ public:
 		_saIters = saIters;
 	}
 
+	/**
+	 * Stop when at most this fraction of the vectors changed cluster in an
+	 * iteration. The default of 0 stops when no vector moves.
+	 */
+	void setMinMovedFraction(float minMovedFraction) {
+		_minMovedFraction = minMovedFraction;
+	}
+
     void setEnforceNumClusters(bool enforceNumClusters) {
         _enforceNumClusters = enforceNumClusters;
     }
@@ -68,10 +76,21 @@ public:
         return _numClusters;
     }
 
+	/**
+	 * The RMSE of each iteration. It is measured while assigning vectors, so
+	 * it is the error of the centroids from the previous iteration.
+	 */
 	vector<float>& getRMSEs() {
 		return rmses;
 	}
 
+	/**
+	 * The number of vectors that changed cluster in each iteration.
+	 */
+	vector<size_t>& getMovedCounts() {
+		return movedCounts;
+	}
+
     vector<Cluster<T>*>& cluster(vector<T*> &data) {
 
 		if (_saIters > 0) {
@@ -94,7 +113,7 @@ public:
         double SSE = 0;
         size_t objects = 0;
         for (Cluster<T>* cluster : _clusters) {
-            auto neighbours = cluster->getNearestList();
+            vector<T*>& neighbours = cluster->getNearestList();
             objects += neighbours.size();
             SSE += _optimizer.sumSquaredError(cluster->getCentroid(), neighbours);
         }
@@ -102,6 +121,40 @@ public:
     }
 
 private:
+	/**
+	 * Statistics of an assignment step. They are calculated in parallel with
+	 * the nearest centroids.
+	 */
+	struct IterationStats {
+		IterationStats() : sse(0), moved(0) { }
+
+		IterationStats& operator+=(const IterationStats &other) {
+			sse += other.sse;
+			moved += other.moved;
+			return *this;
+		}
+
+		// sum of squared distances to the nearest centroid
+		double sse;
+
+		// number of vectors that changed cluster
+		size_t moved;
+	};
+
+	// The RMSE of the last assignment step
+	float assignedRMSE(vector<T*> &data) {
+		return sqrt(_stats.sse / data.size());
+	}
+
+	// Record the statistics of the last assignment step
+	float recordStats(vector<T*> &data) {
+		float rmse = assignedRMSE(data);
+		rmses.push_back(rmse);
+		movedCounts.push_back(_stats.moved);
+		cout << endl << _iterCount << "  " << rmse << "  moved " << _stats.moved;
+		return rmse;
+	}
+
     void finalizeClusters(vector<T*> &data) {      
         // Create list of final clusters to return;
         bool emptyCluster = assignClusters(data);
@@ -148,7 +201,7 @@ private:
         _nearestCentroid.resize(data.size());
         _seeder->seed(data, _centroids, _numClusters);
 
-		float rmseOld, rmseCurr;
+		float rmseCurr;
 
         // Create as many cluster objects as there are centroids
         for (T* c : _centroids) {
@@ -166,22 +219,18 @@ private:
         }
         recalculateCentroids(data);
 
-		rmseCurr = getRMSE();
-		rmseOld = rmseCurr;
-		rmses.push_back(rmseCurr);
-
-		cout << endl << 1 << "  " << rmseCurr;
+        _iterCount = 1;
+		rmseCurr = recordStats(data);
 
         if (_maxIters == 1) {
             return;
         }
 
         _converged = false;
-        _iterCount = 1;
 		//_saIterCount = 0;
 
 		// Do standard k-means
-		innerLoop(data);
+		innerLoop(data, rmseCurr);
 
 		// Do annealing
 		if (_saIters>0) {
@@ -211,23 +260,31 @@ private:
 
 				_iterCount++;
 
+				// Perturbing moves vectors after the assignment step, so the
+				// error is calculated again.
 				rmseCurr = getRMSE();
 				rmses.push_back(rmseCurr);
+				movedCounts.push_back(_stats.moved);
 				cout << endl << _iterCount << "  " << rmseCurr;
 
 				// Do k-means iterations
-				innerLoop(data);
+				innerLoop(data, rmseCurr);
 			}	
 		}
 
     }
 
-	void innerLoop(vector<T*> &data)  {
+	/**
+	 * Runs k-means iterations until the RMSE improves by less than eps, at
+	 * most a fraction minMovedFraction of the vectors move, or maxIters is
+	 * reached. The RMSE and moved counts come from the assignment step, so
+	 * no extra pass over the data is needed.
+	 *
+	 * @param rmseOld The RMSE before the first iteration.
+	 */
+	void innerLoop(vector<T*> &data, float rmseOld)  {
 		
-		float rmseOld, rmseCurr;
-
-		rmseCurr = getRMSE();
-		rmseOld = rmseCurr;
+		float rmseCurr;
 		
 		int innerIterCount = 0;
 
@@ -236,15 +293,16 @@ private:
 		while (!_converged) {
 			
 			vectorsToNearestCentroid(data);
+			if (_stats.moved <= _minMovedFraction * data.size()) {
+				_converged = true;
+			}
 			assignCentroids(data);
 			recalculateCentroids(data);
 
 			_iterCount++;
 			innerIterCount++;
 
-			rmseCurr = getRMSE();
-			rmses.push_back(rmseCurr);
-			cout << endl << _iterCount << "  " << getRMSE();
+			rmseCurr = recordStats(data);
 
 			if ((rmseOld - rmseCurr) < _eps) break;
 			rmseOld = rmseCurr;
@@ -312,20 +370,25 @@ private:
         for (Cluster<T> *c : _clusters) {
             c->clearNearest();
         }
-        _converged = true;
 
 		
 		//ThreadPool tPool(4);
 
-		auto func = [=](int i) {
-			auto nearest = _optimizer.nearest(data[i], _centroids);
-			if (nearest.index != _nearestCentroid[i]) {
-				_converged = false;
+		auto func = [&](int begin, int end) {
+			IterationStats stats;
+			for (int i = begin; i < end; i++) {
+				auto nearest = _optimizer.nearest(data[i], _centroids);
+				if (nearest.index != _nearestCentroid[i]) {
+					stats.moved++;
+				}
+				_nearestCentroid[i] = nearest.index;
+				stats.sse += _optimizer.squaredDistance(data[i], nearest.key);
 			}
-			_nearestCentroid[i] = nearest.index;
+			return stats;
 		};
 
-		parallel_for(tPool, 0, data.size(), 200, func);
+		_stats = parallel_reduce(tPool, 0, data.size(), 200, IterationStats(), func);
+		_converged = _stats.moved == 0;
 
 		// make sure all memory writes are visible on all CPUs
 		atomic_thread_fence(std::memory_order_release);
@@ -445,6 +508,12 @@ private:
 	// The number of annealing operations
 	int _saIters = 0;
 
+	// Converged when at most this fraction of vectors move in an iteration
+	float _minMovedFraction = 0;
+
+	// Statistics of the last assignment step
+	IterationStats _stats;
+
     // has the clustering converged
     std::atomic<bool> _converged; 
 
@@ -454,6 +523,7 @@ private:
 	ThreadPool tPool;
 
 	vector<float> rmses;
+	vector<size_t> movedCounts;
 };
 
 
@@ -194,6 +194,7 @@ void sigKmeansCluster(vector<SVector<bool>*> &vectors, HOptions &options) {
 	clusterer.setEps(options.eps);
 	clusterer.setSAIters(options.saIters);
 	clusterer.setSAStart(options.saStart);
+	clusterer.setMinMovedFraction(options.minMoved);
 			
 	cout << endl << "Clustering ... " << endl; 
 
@@ -203,6 +204,7 @@ void sigKmeansCluster(vector<SVector<bool>*> &vectors, HOptions &options) {
 	cout << "number of clusters = " << options.numClusters << endl;
 	cout << "maxiters = " << options.maxIters << endl;
 	cout << "eps = " << options.eps << endl;
+	cout << "min moved fraction = " << options.minMoved << endl;
 	cout << "sim. annealing iters = " << options.saIters << endl;
 
 	auto start = std::chrono::steady_clock::now();
@@ -238,6 +240,7 @@ void parseOptions(int argc, char **argv) {
 	if ((i = ArgPos((char *)"-eps", argc, argv)) > 0) options.eps = atof(argv[i + 1]);
 	if ((i = ArgPos((char *)"-sastart", argc, argv)) > 0) options.saStart = atof(argv[i + 1]);
 	if ((i = ArgPos((char *)"-saiters", argc, argv)) > 0) options.saIters = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *)"-minmoved", argc, argv)) > 0) options.minMoved = atof(argv[i + 1]);
 }
 
 
@@ -84,7 +84,7 @@ public:
 	}
 
 	const string getID() {
-		return &_id;
+		return _id;
 	}
 
 	void set(size_t i, T val) {
@@ -172,9 +172,7 @@ public:
 		_data = new block_type[_numBlocks];
 
 		// initialise bit vector
-		for (int i = 0; i < _numBlocks; i++) {
-			setBlock(i, vec._data[i]);
-		}
+		memcpy(_data, vec._data, _numBlocks * sizeof (block_type));
 	}
 
 	SVector(SVector<bool> *vec) {
@@ -183,9 +181,7 @@ public:
 		_data = new block_type[_numBlocks];
 
 		// initialise bit vector
-		for (int i = 0; i < _numBlocks; i++) {
-			setBlock(i, vec->_data[i]);
-		}
+		memcpy(_data, vec->_data, _numBlocks * sizeof (block_type));
 	}
 
 	~SVector() {
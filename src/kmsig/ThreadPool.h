@@ -2,106 +2,232 @@
 #define THREAD_POOL_H
 
 #include <vector>
-#include <queue>
+#include <deque>
 #include <memory>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
-#include <future>
-#include <functional>
-#include <stdexcept>
+#include <atomic>
 
 //------------------------------------------------
-// Simple Thread Pool
-// See: http://progsch.net/wordpress/?p=81
-// 
-// 
-// Some alterations by Lance.
-// Changed the constructor.
-// Added init(size_t numThreads) method.
+// Work stealing thread pool
+//
+// The pool runs one blocking job at a time. A job is a number of chunks and a
+// function that processes one chunk. It is used by parallel_for and
+// parallel_reduce in HParallel.h.
+//
+// Every participating thread has its own deque of chunk ranges. The calling
+// thread starts with the whole range. A thread takes the newest range from
+// the back of its own deque and splits it in half, pushing the upper half
+// back, until a single chunk remains to process. Idle threads steal the
+// oldest, and so largest, range from the front of another thread's deque.
+// This keeps threads busy without a shared queue, and without allocating a
+// task or future per chunk.
+//
+// The calling thread works as well, so init(n) starts n - 1 workers. Jobs
+// must not be nested.
 //------------------------------------------------
 
 class ThreadPool {
 public:
-    ThreadPool();
+	ThreadPool();
 	void init(size_t numThreads);
-    template<class F, class... Args>
-    auto enqueue(F&& f, Args&&... args) 
-        -> std::future<typename std::result_of<F(Args...)>::type>;
-    ~ThreadPool();
+	~ThreadPool();
+
+	// Calls f(chunk) for every chunk in [0, numChunks) and returns when all
+	// chunks are done.
+	template<typename Func>
+	void run(int numChunks, Func &f);
+
 private:
-    // need to keep track of threads so we can join them
-    std::vector< std::thread > workers;
-    // the task queue
-    std::queue< std::function<void()> > tasks;
-    
-    // synchronization
-    std::mutex queue_mutex;
-    std::condition_variable condition;
-    bool stop;
+	ThreadPool(const ThreadPool&);
+	ThreadPool& operator=(const ThreadPool&);
+
+	// A range of chunks [begin, end)
+	struct Range {
+		int begin;
+		int end;
+	};
+
+	struct Queue {
+		std::mutex mutex;
+		std::deque<Range> ranges;
+	};
+
+	struct Task {
+		virtual ~Task() { }
+		virtual void operator()(int chunk) = 0;
+	};
+
+	template<typename Func>
+	struct FuncTask : public Task {
+		FuncTask(Func &f) : f(f) { }
+		void operator()(int chunk) { f(chunk); }
+		Func &f;
+	};
+
+	void execute(Task *task, int numChunks);
+	void worker(size_t self);
+	void participate(size_t self);
+	void push(size_t self, Range range);
+	bool pop(size_t self, Range &range);
+	bool steal(size_t self, Range &range, unsigned &seed);
+
+	std::vector< std::thread > workers;
+
+	// One queue per worker, and the last one for the calling thread
+	std::vector< std::unique_ptr<Queue> > queues;
+
+	// The current job
+	Task *task;
+	std::atomic<int> pending; // chunks not yet processed
+	std::atomic<int> busy; // workers taking part in a job
+
+	// Wakes the workers for a new job
+	std::mutex mutex;
+	std::condition_variable condition;
+	unsigned generation;
+	bool stop;
 };
 
-void ThreadPool::init(size_t threads) {
-	for (size_t i = 0; i<threads; ++i)
-		workers.emplace_back(
-		[this]
+inline ThreadPool::ThreadPool()
+	: task(NULL), pending(0), busy(0), generation(0), stop(false)
+{
+	queues.emplace_back(new Queue());
+}
+
+inline void ThreadPool::init(size_t numThreads) {
+	for (size_t i = 1; i < numThreads; ++i) {
+		queues.emplace_back(new Queue());
+	}
+	// the queue of the calling thread stays last
+	std::swap(queues.front(), queues.back());
+	for (size_t i = 0; i + 1 < numThreads; ++i) {
+		workers.emplace_back([this, i] { worker(i); });
+	}
+}
+
+// the destructor joins all threads
+inline ThreadPool::~ThreadPool()
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		stop = true;
+	}
+	condition.notify_all();
+	for (size_t i = 0; i < workers.size(); ++i)
+		workers[i].join();
+}
+
+template<typename Func>
+void ThreadPool::run(int numChunks, Func &f) {
+	FuncTask<Func> funcTask(f);
+	execute(&funcTask, numChunks);
+}
+
+inline void ThreadPool::execute(Task *task, int numChunks) {
+	if (numChunks <= 0) {
+		return;
+	}
+	if (workers.empty()) {
+		for (int i = 0; i < numChunks; ++i) {
+			(*task)(i);
+		}
+		return;
+	}
+
+	size_t self = queues.size() - 1;
+	this->task = task;
+	pending = numChunks;
+	Range all = { 0, numChunks };
+	push(self, all);
 	{
-		for (;;)
+		std::unique_lock<std::mutex> lock(mutex);
+		generation++;
+	}
+	condition.notify_all();
+
+	participate(self);
+
+	// wait for workers to finish stealing before the job goes away
+	while (busy > 0) {
+		std::this_thread::yield();
+	}
+}
+
+inline void ThreadPool::worker(size_t self) {
+	unsigned seen = 0;
+	for (;;) {
 		{
-			std::unique_lock<std::mutex> lock(this->queue_mutex);
-			while (!this->stop && this->tasks.empty())
-				this->condition.wait(lock);
-			if (this->stop && this->tasks.empty())
+			std::unique_lock<std::mutex> lock(mutex);
+			while (!stop && generation == seen)
+				condition.wait(lock);
+			if (stop)
 				return;
-			std::function<void()> task(this->tasks.front());
-			this->tasks.pop();
-			lock.unlock();
-			task();
+			seen = generation;
+			busy++;
 		}
+		participate(self);
+		busy--;
 	}
-	);
 }
-// the constructor just launches some amount of workers
-inline ThreadPool::ThreadPool()
-    :   stop(false)
-{
 
+inline void ThreadPool::participate(size_t self) {
+	unsigned seed = 2654435761u * (unsigned)(self + 1);
+	Range range;
+	while (pending > 0) {
+		if (pop(self, range) || steal(self, range, seed)) {
+			// split down to a single chunk, leaving the rest to be stolen
+			while (range.end - range.begin > 1) {
+				int mid = range.begin + (range.end - range.begin) / 2;
+				Range upper = { mid, range.end };
+				push(self, upper);
+				range.end = mid;
+			}
+			(*task)(range.begin);
+			pending--;
+		} else {
+			std::this_thread::yield();
+		}
+	}
 }
 
-// add new work item to the pool
-template<class F, class... Args>
-auto ThreadPool::enqueue(F&& f, Args&&... args) 
-    -> std::future<typename std::result_of<F(Args...)>::type>
-{
-    typedef typename std::result_of<F(Args...)>::type return_type;
-    
-    // don't allow enqueueing after stopping the pool
-    if(stop)
-        throw std::runtime_error("enqueue on stopped ThreadPool");
-
-    auto task = std::make_shared< std::packaged_task<return_type()> >(
-            std::bind(std::forward<F>(f), std::forward<Args>(args)...)
-        );
-        
-    std::future<return_type> res = task->get_future();
-    {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        tasks.push([task](){ (*task)(); });
-    }
-    condition.notify_one();
-    return res;
+inline void ThreadPool::push(size_t self, Range range) {
+	Queue &queue = *queues[self];
+	std::unique_lock<std::mutex> lock(queue.mutex);
+	queue.ranges.push_back(range);
 }
 
-// the destructor joins all threads
-inline ThreadPool::~ThreadPool()
-{
-    {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        stop = true;
-    }
-    condition.notify_all();
-    for(size_t i = 0;i<workers.size();++i)
-        workers[i].join();
+inline bool ThreadPool::pop(size_t self, Range &range) {
+	Queue &queue = *queues[self];
+	std::unique_lock<std::mutex> lock(queue.mutex);
+	if (queue.ranges.empty())
+		return false;
+	range = queue.ranges.back();
+	queue.ranges.pop_back();
+	return true;
+}
+
+inline bool ThreadPool::steal(size_t self, Range &range, unsigned &seed) {
+	size_t n = queues.size();
+	// xorshift to pick where to start looking
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	size_t start = seed % n;
+	for (size_t i = 0; i < n; ++i) {
+		size_t victim = (start + i) % n;
+		if (victim == self)
+			continue;
+		Queue &queue = *queues[victim];
+		std::unique_lock<std::mutex> lock(queue.mutex);
+		if (!queue.ranges.empty()) {
+			range = queue.ranges.front();
+			queue.ranges.pop_front();
+			return true;
+		}
+	}
+	return false;
 }
 
 #endif
@@ -0,0 +1,239 @@
+#ifndef ACCUMULATOR_H
+#define	ACCUMULATOR_H
+
+#include "StdIncludes.h"
+#include "BitSlicedCounter.h"
+#include "SVector.h"
+
+namespace lmw {
+
+/**
+ * AccumulatorOps are the operations StreamingEMTree performs on its
+ * ACCUMULATOR vectors, which sum the vectors inserted into a leaf cluster.
+ *
+ * The default works on any vector of numbers, such as SVector<uint32_t>,
+ * one dimension at a time. It requires
+ *      ACCUMULATOR(size_t dimensions)
+ *      size_t size()
+ *      void setAll(value)
+ *      value_type& operator[](size_t i)
+ *
+ * Specializations may store the sums differently, as long as they provide
+ * the same static functions. value_type is the type sums are exchanged in,
+ * for example, in checkpoints.
+ */
+template <typename ACCUMULATOR>
+struct AccumulatorOps {
+    typedef typename std::remove_reference<
+            decltype(std::declval<ACCUMULATOR&>()[0])>::type value_type;
+
+    static void clear(ACCUMULATOR* accumulator) {
+        accumulator->setAll(0);
+    }
+
+    /**
+     * Adds the set bits of n bit vectors a block at a time, skipping the
+     * dimensions that are zero.
+     */
+    static void add(ACCUMULATOR* accumulator, SVector<bool>** objects, size_t n) {
+        for (size_t j = 0; j < n; j++) {
+            block_type* data = objects[j]->getData();
+            for (size_t i = 0; i < objects[j]->getNumBlocks(); i++) {
+                block_type bits = data[i];
+                size_t offset = i * W_SIZE;
+                while (bits) {
+                    (*accumulator)[offset + __builtin_ctzll(bits)] += 1;
+                    bits &= bits - 1;
+                }
+            }
+        }
+    }
+
+    template <typename V>
+    static void add(ACCUMULATOR* accumulator, V** objects, size_t n) {
+        for (size_t j = 0; j < n; j++) {
+            for (size_t i = 0; i < accumulator->size(); i++) {
+                (*accumulator)[i] += (*objects[j])[i];
+            }
+        }
+    }
+
+    /**
+     * total += accumulator
+     */
+    static void merge(ACCUMULATOR* total, ACCUMULATOR* accumulator) {
+        for (size_t i = 0; i < accumulator->size(); i++) {
+            (*total)[i] += (*accumulator)[i];
+        }
+    }
+
+    /**
+     * Sets the bits of key where more than half of count vectors are set.
+     */
+    static void majority(SVector<bool>* key, ACCUMULATOR* accumulator, uint64_t count) {
+        key->setAllBlocks(0);
+        for (size_t i = 0; i < key->size(); i++) {
+            if ((*accumulator)[i] > (count / 2)) {
+                key->set(i);
+            }
+        }
+    }
+
+    static void getValues(ACCUMULATOR* accumulator, value_type* values) {
+        for (size_t i = 0; i < accumulator->size(); i++) {
+            values[i] = (*accumulator)[i];
+        }
+    }
+
+    static void setValues(ACCUMULATOR* accumulator, const value_type* values) {
+        for (size_t i = 0; i < accumulator->size(); i++) {
+            (*accumulator)[i] = values[i];
+        }
+    }
+
+    static void addValues(ACCUMULATOR* accumulator, const value_type* values) {
+        for (size_t i = 0; i < accumulator->size(); i++) {
+            (*accumulator)[i] += values[i];
+        }
+    }
+};
+
+/**
+ * An UPDATE policy sets a key of StreamingEMTree from the sum of the
+ * vectors in its accumulator at the end of a pass. It implements
+ *      template <typename ACCUMULATOR>
+ *      void operator()(T* key, ACCUMULATOR* accumulator, uint64_t count)
+ *
+ * DefaultUpdate<T>::type is the policy used for keys of type T.
+ */
+
+/**
+ * A bit is set in the key when it is set in more than half of the vectors,
+ * like meanBitPrototype.
+ */
+struct majorityUpdate {
+
+    template <typename ACCUMULATOR>
+    void operator()(SVector<bool>* key, ACCUMULATOR* accumulator, uint64_t count) const {
+        AccumulatorOps<ACCUMULATOR>::majority(key, accumulator, count);
+    }
+};
+
+/**
+ * The key is the mean of the vectors, like meanPrototype. Keys of empty
+ * clusters are left as they are.
+ */
+template <typename T>
+struct meanUpdate {
+
+    template <typename ACCUMULATOR>
+    void operator()(T* key, ACCUMULATOR* accumulator, uint64_t count) const {
+        if (count == 0) {
+            return;
+        }
+        for (size_t i = 0; i < key->size(); i++) {
+            (*key)[i] = (*accumulator)[i] / double(count);
+        }
+    }
+};
+
+template <typename T>
+struct DefaultUpdate {
+    typedef meanUpdate<T> type;
+};
+
+template <>
+struct DefaultUpdate<SVector<bool> > {
+    typedef majorityUpdate type;
+};
+
+/**
+ * A BitSlicedAccumulator sums bit vectors with a BitSlicedCounter. It uses
+ * log2(count) bits per dimension instead of a whole integer, for example,
+ * 11 bits per dimension for a cluster of 2000 vectors instead of 32, and no
+ * memory at all until something is added. Vectors are added a word at a
+ * time instead of one set bit at a time.
+ *
+ * The number of dimensions must be a multiple of 64. The values exchanged
+ * with AccumulatorOps are uint32_t, as for SVector<uint32_t>, so checkpoints
+ * and partial results of either accumulator can be read by the other.
+ *
+ * For example,
+ *      typedef StreamingEMTree<SVector<bool>, BitSlicedAccumulator, OPTIMIZER>
+ *              StreamingEMTree_t;
+ */
+class BitSlicedAccumulator {
+public:
+
+    explicit BitSlicedAccumulator(size_t dimensions) :
+            _dimensions(dimensions), _counter(dimensions / W_SIZE) {
+        if (dimensions % W_SIZE != 0) {
+            throw runtime_error("dimensions are not divisible by 64");
+        }
+    }
+
+    size_t size() const {
+        return _dimensions;
+    }
+
+    /**
+     * The sum of dimension i.
+     */
+    uint32_t operator[](size_t i) const {
+        return _counter.count(i);
+    }
+
+    BitSlicedCounter& getCounter() {
+        return _counter;
+    }
+
+private:
+    size_t _dimensions;
+    BitSlicedCounter _counter;
+};
+
+template <>
+struct AccumulatorOps<BitSlicedAccumulator> {
+    typedef uint32_t value_type;
+
+    static void clear(BitSlicedAccumulator* accumulator) {
+        accumulator->getCounter().clear();
+    }
+
+    static void add(BitSlicedAccumulator* accumulator, SVector<bool>** objects, size_t n) {
+        const size_t TILE = 64;
+        const block_type* rows[TILE];
+        for (size_t j = 0; j < n; j += TILE) {
+            size_t count = std::min(TILE, n - j);
+            for (size_t r = 0; r < count; r++) {
+                rows[r] = objects[j + r]->getData();
+            }
+            accumulator->getCounter().add(rows, count);
+        }
+    }
+
+    static void merge(BitSlicedAccumulator* total, BitSlicedAccumulator* accumulator) {
+        total->getCounter().add(accumulator->getCounter());
+    }
+
+    static void majority(SVector<bool>* key, BitSlicedAccumulator* accumulator, uint64_t count) {
+        accumulator->getCounter().greaterThan(count / 2, key->getData());
+    }
+
+    static void getValues(BitSlicedAccumulator* accumulator, value_type* values) {
+        accumulator->getCounter().getCounts(values);
+    }
+
+    static void setValues(BitSlicedAccumulator* accumulator, const value_type* values) {
+        accumulator->getCounter().clear();
+        accumulator->getCounter().addCounts(values);
+    }
+
+    static void addValues(BitSlicedAccumulator* accumulator, const value_type* values) {
+        accumulator->getCounter().addCounts(values);
+    }
+};
+
+} // namespace lmw
+
+#endif	/* ACCUMULATOR_H */
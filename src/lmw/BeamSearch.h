@@ -0,0 +1,192 @@
+#ifndef BEAMSEARCH_H
+#define	BEAMSEARCH_H
+
+#include "StdIncludes.h"
+#include "Distance.h"
+#include "Node.h"
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
+
+namespace lmw {
+
+/**
+ * A search result, an object and its distance to the query.
+ */
+template <typename T>
+struct Neighbour {
+    T* object;
+    double distance;
+};
+
+/**
+ * BeamSearch finds approximate nearest neighbours in an m-way tree of Nodes.
+ *
+ * Instead of following only the nearest key at each level, the beamWidth
+ * nearest children out of all the nodes in the beam are followed to the next
+ * level. The objects in all leaves reached are then compared with the query,
+ * and the k nearest are returned, nearest first. There are fewer when the
+ * leaves reached hold fewer than k objects. A beamWidth of 1 is the
+ * greedy descent used for insertion. Wider beams find more of the true
+ * nearest neighbours at the cost of scoring more leaves.
+ *
+ * Distances are calculated with DistanceBatch, so bit vectors are compared
+ * with the Hamming kernels. Nearer means a smaller DISTANCE.
+ *
+ * A BeamSearch reuses buffers between searches and must not be shared between
+ * threads. The batch search creates one per thread.
+ *
+ * For example,
+ *      BeamSearch<SVector<bool>, hammingDistance> beamSearch(10, 4);
+ *      vector<Neighbour<SVector<bool> > > neighbours;
+ *      beamSearch.search(root, query, neighbours);
+ */
+template <typename T, typename DISTANCE>
+class BeamSearch {
+public:
+
+    BeamSearch(int k, int beamWidth) : _k(k), _beamWidth(beamWidth) {
+    }
+
+    void search(Node<T>* root, T* query, vector<Neighbour<T> >& neighbours) {
+        search(root, query, _defaultAccessor, neighbours);
+    }
+
+    /**
+     * An ACCESSOR functor implements T* operator()(KEY* key) to search trees
+     * with more complex keys, as in Optimizer::nearest(). The neighbours are
+     * the T* of the leaf keys.
+     */
+    template <typename KEY, typename ACCESSOR>
+    void search(Node<KEY>* root, T* query, ACCESSOR& accessor,
+            vector<Neighbour<T> >& neighbours) {
+        neighbours.clear();
+        vector<Node<KEY>*> beam(1, root);
+        vector<Node<KEY>*> leaves;
+        vector<Candidate<KEY> > candidates;
+        while (!beam.empty()) {
+            candidates.clear();
+            for (Node<KEY>* n : beam) {
+                if (n->isLeaf()) {
+                    leaves.push_back(n);
+                    continue;
+                }
+                distances(query, n->getKeys(), accessor);
+                for (size_t i = 0; i < n->size(); ++i) {
+                    candidates.push_back({_distances[i], n->getChild(i)});
+                }
+            }
+            best(candidates, _beamWidth);
+            beam.clear();
+            for (Candidate<KEY>& c : candidates) {
+                beam.push_back(c.node);
+            }
+        }
+
+        for (Node<KEY>* leaf : leaves) {
+            vector<KEY*>& keys = leaf->getKeys();
+            distances(query, keys, accessor);
+            for (size_t i = 0; i < keys.size(); ++i) {
+                neighbours.push_back({accessor(keys[i]), _distances[i]});
+            }
+        }
+        best(neighbours, _k);
+    }
+
+    void search(Node<T>* root, vector<T*>& queries,
+            vector<vector<Neighbour<T> > >& neighbours) {
+        search(root, queries, _defaultAccessor, neighbours);
+    }
+
+    /**
+     * Searches for all queries in parallel. neighbours[i] are the neighbours
+     * of queries[i].
+     */
+    template <typename KEY, typename ACCESSOR>
+    void search(Node<KEY>* root, vector<T*>& queries, ACCESSOR& accessor,
+            vector<vector<Neighbour<T> > >& neighbours) {
+        neighbours.resize(queries.size());
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, queries.size(), 16),
+                [&](const tbb::blocked_range<size_t>& r) {
+                    BeamSearch<T, DISTANCE> local(_k, _beamWidth);
+                    for (size_t i = r.begin(); i != r.end(); ++i) {
+                        local.search(root, queries[i], accessor, neighbours[i]);
+                    }
+                }
+        );
+    }
+
+private:
+    static const size_t KEY_TILE = 64;
+
+    template <typename KEY>
+    struct Candidate {
+        double distance;
+        Node<KEY>* node;
+    };
+
+    struct DefaultAccessor {
+        T* operator()(T* key) {
+            return key;
+        }
+    };
+
+    /**
+     * Keeps the n nearest of items, nearest first. Ties keep their order.
+     * Only the n nearest are sorted.
+     */
+    template <typename ITEM>
+    void best(vector<ITEM>& items, int n) {
+        size_t count = std::min(items.size(), size_t(std::max(n, 0)));
+        _order.resize(items.size());
+        for (size_t i = 0; i < _order.size(); ++i) {
+            _order[i] = i;
+        }
+        std::partial_sort(_order.begin(), _order.begin() + count, _order.end(),
+                [&items](uint32_t a, uint32_t b) {
+                    return items[a].distance < items[b].distance
+                            || (items[a].distance == items[b].distance && a < b);
+                });
+        vector<ITEM> nearest;
+        nearest.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            nearest.push_back(items[_order[i]]);
+        }
+        items.swap(nearest);
+    }
+
+    /**
+     * Sets _distances[i] to the distance from query to keys[i].
+     */
+    template <typename KEY, typename ACCESSOR>
+    void distances(T* query, vector<KEY*>& keys, ACCESSOR& accessor) {
+        typename DistanceBatch<T, DISTANCE>::value_type tileDistances[KEY_TILE];
+        T* tile[KEY_TILE];
+        _distances.resize(keys.size());
+        for (size_t i = 0; i < keys.size(); i += KEY_TILE) {
+            size_t count = std::min(KEY_TILE, keys.size() - i);
+            for (size_t j = 0; j < count; ++j) {
+                tile[j] = accessor(keys[i + j]);
+            }
+            _batchDistance(_distance, query, tile, count, tileDistances);
+            for (size_t j = 0; j < count; ++j) {
+                _distances[i + j] = tileDistances[j];
+            }
+        }
+    }
+
+    // The number of neighbours to return
+    int _k;
+
+    // The number of nodes followed at each level
+    int _beamWidth;
+
+    DISTANCE _distance;
+    DistanceBatch<T, DISTANCE> _batchDistance;
+    DefaultAccessor _defaultAccessor;
+    vector<double> _distances;
+    vector<uint32_t> _order;
+};
+
+} // namespace lmw
+
+#endif	/* BEAMSEARCH_H */
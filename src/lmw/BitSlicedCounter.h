@@ -0,0 +1,250 @@
+#ifndef BITSLICEDCOUNTER_H
+#define	BITSLICEDCOUNTER_H
+
+#include "StdIncludes.h"
+#include "SVector.h"
+
+namespace lmw {
+
+/**
+ * A BitSlicedCounter counts how many times each bit of a bit vector has been
+ * set. The counts are stored vertically as bit planes. Plane p holds bit p of
+ * every count, so the counts of 64 dimensions are updated together with a
+ * handful of word operations instead of one increment per set bit.
+ *
+ * Adding a vector ripples a carry up through the planes of each block. Groups
+ * of 8 vectors are first reduced with a tree of carry save adders, so they
+ * cost 4 ripple adds instead of 8. Planes are added as counts grow, so the
+ * memory used is numBlocks * log2(total) words.
+ *
+ * The counts are compared with a threshold without unpacking them. This is
+ * what the majority vote of a bit vector prototype needs.
+ *
+ * For example,
+ *      BitSlicedCounter counter(numBlocks);
+ *      for (SVector<bool>* v : vectors) {
+ *          counter.add(v->getData());
+ *      }
+ *      // set each bit of mean that is set in more than half of vectors
+ *      counter.greaterThan(vectors.size() / 2, mean->getData());
+ */
+class BitSlicedCounter {
+public:
+
+    explicit BitSlicedCounter(size_t numBlocks) : _numBlocks(numBlocks), _numPlanes(0) {
+    }
+
+    /**
+     * Adds 1 to the count of every set bit.
+     */
+    void add(const block_type* data) {
+        for (size_t i = 0; i < _numBlocks; ++i) {
+            addAt(i, data[i], 0);
+        }
+    }
+
+    /**
+     * Adds weight to the count of every set bit. The addend has data in each
+     * plane where the weight has a set bit, and it is added with a full adder
+     * across the planes.
+     */
+    void add(const block_type* data, uint64_t weight) {
+        size_t weightPlanes = 0;
+        while (weightPlanes < 64 && (weight >> weightPlanes) != 0) {
+            ++weightPlanes;
+        }
+        reservePlanes(weightPlanes);
+        for (size_t i = 0; i < _numBlocks; ++i) {
+            if (data[i] == 0) {
+                continue;
+            }
+            block_type carry = 0;
+            size_t plane = 0;
+            for (; plane < weightPlanes; ++plane) {
+                block_type addend = ((weight >> plane) & 1) ? data[i] : 0;
+                block_type& bits = _planes[plane * _numBlocks + i];
+                block_type sum = bits ^ addend;
+                block_type next = (bits & addend) | (sum & carry);
+                bits = sum ^ carry;
+                carry = next;
+            }
+            addAt(i, carry, plane);
+        }
+    }
+
+    /**
+     * Adds 1 to the count of every set bit in each of n rows.
+     */
+    void add(const block_type* const* rows, size_t n) {
+        size_t r = 0;
+        for (; r + 8 <= n; r += 8) {
+            addGroup(rows + r);
+        }
+        for (; r < n; ++r) {
+            add(rows[r]);
+        }
+    }
+
+    /**
+     * Adds the counts of other, which has the same number of blocks, a plane
+     * at a time.
+     */
+    void add(const BitSlicedCounter& other) {
+        for (size_t plane = 0; plane < other._numPlanes; ++plane) {
+            for (size_t i = 0; i < _numBlocks; ++i) {
+                addAt(i, other._planes[plane * _numBlocks + i], plane);
+            }
+        }
+    }
+
+    /**
+     * Adds counts[d] to the count of every dimension d. There are numBlocks
+     * * 64 counts.
+     */
+    template <typename VALUE>
+    void addCounts(const VALUE* counts) {
+        for (size_t i = 0; i < _numBlocks; ++i) {
+            const VALUE* block = counts + i * W_SIZE;
+            VALUE any = 0;
+            for (size_t j = 0; j < W_SIZE; ++j) {
+                any |= block[j];
+            }
+            for (size_t plane = 0; (any >> plane) != 0; ++plane) {
+                block_type bits = 0;
+                for (size_t j = 0; j < W_SIZE; ++j) {
+                    bits |= block_type((block[j] >> plane) & 1) << j;
+                }
+                addAt(i, bits, plane);
+            }
+        }
+    }
+
+    /**
+     * Sets counts[d] to the count of every dimension d.
+     */
+    template <typename VALUE>
+    void getCounts(VALUE* counts) const {
+        std::fill(counts, counts + _numBlocks * W_SIZE, VALUE(0));
+        for (size_t plane = 0; plane < _numPlanes; ++plane) {
+            for (size_t i = 0; i < _numBlocks; ++i) {
+                block_type bits = _planes[plane * _numBlocks + i];
+                while (bits) {
+                    counts[i * W_SIZE + __builtin_ctzll(bits)] |= VALUE(1) << plane;
+                    bits &= bits - 1;
+                }
+            }
+        }
+    }
+
+    /**
+     * Sets bit i of out if count i is greater than threshold. out must have
+     * numBlocks blocks.
+     */
+    void greaterThan(uint64_t threshold, block_type* out) const {
+        // compare from the most significant plane down
+        size_t top = _numPlanes;
+        while (top < 64 && (threshold >> top) != 0) {
+            ++top;
+        }
+        for (size_t i = 0; i < _numBlocks; ++i) {
+            block_type greater = 0, equal = ~block_type(0);
+            for (size_t plane = top; plane-- > 0;) {
+                block_type bits = plane < _numPlanes ? _planes[plane * _numBlocks + i] : 0;
+                if ((threshold >> plane) & 1) {
+                    equal &= bits;
+                } else {
+                    greater |= equal & bits;
+                    equal &= ~bits;
+                }
+            }
+            out[i] = greater;
+        }
+    }
+
+    /**
+     * The count of a single dimension.
+     */
+    uint64_t count(size_t dimension) const {
+        size_t block = dimension >> BITS_WS;
+        block_type mask = block_type(1) << (dimension & MASK);
+        uint64_t total = 0;
+        for (size_t plane = 0; plane < _numPlanes; ++plane) {
+            if (_planes[plane * _numBlocks + block] & mask) {
+                total |= uint64_t(1) << plane;
+            }
+        }
+        return total;
+    }
+
+    void clear() {
+        _planes.clear();
+        _numPlanes = 0;
+    }
+
+    size_t getNumBlocks() const {
+        return _numBlocks;
+    }
+
+    size_t getNumPlanes() const {
+        return _numPlanes;
+    }
+
+private:
+
+    /**
+     * Adds carry to block i starting at plane. A new plane is created when
+     * the carry propagates past the top plane.
+     */
+    void addAt(size_t i, block_type carry, size_t plane) {
+        while (carry != 0) {
+            reservePlanes(plane + 1);
+            block_type& bits = _planes[plane * _numBlocks + i];
+            block_type next = bits & carry;
+            bits ^= carry;
+            carry = next;
+            ++plane;
+        }
+    }
+
+    void reservePlanes(size_t numPlanes) {
+        if (numPlanes > _numPlanes) {
+            // grow exactly, as many counters may be kept at once
+            _planes.reserve(numPlanes * _numBlocks);
+            _planes.resize(numPlanes * _numBlocks, 0);
+            _numPlanes = numPlanes;
+        }
+    }
+
+    // carry save adder: h:l = a + b + c
+    static inline void csa(block_type& h, block_type& l, block_type a, block_type b, block_type c) {
+        block_type u = a ^ b;
+        h = (a & b) | (u & c);
+        l = u ^ c;
+    }
+
+    void addGroup(const block_type* const* rows) {
+        for (size_t i = 0; i < _numBlocks; ++i) {
+            block_type ones = 0, twos = 0, fours = 0, eights;
+            block_type twosA, twosB, foursA, foursB;
+            csa(twosA, ones, ones, rows[0][i], rows[1][i]);
+            csa(twosB, ones, ones, rows[2][i], rows[3][i]);
+            csa(foursA, twos, twos, twosA, twosB);
+            csa(twosA, ones, ones, rows[4][i], rows[5][i]);
+            csa(twosB, ones, ones, rows[6][i], rows[7][i]);
+            csa(foursB, twos, twos, twosA, twosB);
+            csa(eights, fours, fours, foursA, foursB);
+            addAt(i, ones, 0);
+            addAt(i, twos, 1);
+            addAt(i, fours, 2);
+            addAt(i, eights, 3);
+        }
+    }
+
+    size_t _numBlocks;
+    size_t _numPlanes;
+    vector<block_type> _planes; // plane p of block i is at p * _numBlocks + i
+};
+
+} // namespace lmw
+
+#endif	/* BITSLICEDCOUNTER_H */
@@ -29,6 +29,11 @@ public:
         _nearest.push_back(neighbour);
     }
 
+    // Replaces the nearest vectors with [begin, end).
+    void setNearest(T** begin, T** end) {
+        _nearest.assign(begin, end);
+    }
+
     T* getCentroid() {
         return _centroid;
     }
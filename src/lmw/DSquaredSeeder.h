@@ -47,7 +47,7 @@ public:
 		int dataCount = data.size();
         float currentPot = 0;
 		vector<float> closestDistSq;
-		closestDistSq.reserve(dataCount);
+		closestDistSq.resize(dataCount);
 
 		centroids.clear();
 
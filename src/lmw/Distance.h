@@ -71,6 +71,54 @@ struct euclideanDistance {
     euclideanDistanceSq<T> _squared;
 };
 
+/**
+ * DistanceBatch calculates the distance from one object to many. It is used by
+ * Optimizer::nearestBatch to compare a query against a tile of keys.
+ * 
+ * The default calls the DISTANCE function for each key. Specializations may
+ * use a cheaper value_type and a vectorized kernel.
+ * 
+ * The required operations are
+ *      // The type distances are returned in. It must convert to double.
+ *      typedef ... value_type;
+ * 
+ *      // out[i] = distance(object, keys[i]) for i < n
+ *      void operator()(DISTANCE&, T* object, T** keys, size_t n, value_type* out)
+ */
+template <typename T, typename DISTANCE>
+struct DistanceBatch {
+    typedef double value_type;
+
+    void operator()(DISTANCE& distance, T* object, T** keys, size_t n, value_type* out) const {
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = distance(object, keys[i]);
+        }
+    }
+};
+
+/**
+ * Hamming distances are integers and are calculated by the one to many kernel
+ * in HammingKernels.h.
+ */
+template <>
+struct DistanceBatch<SVector<bool>, hammingDistance> {
+    typedef int value_type;
+
+    void operator()(hammingDistance& distance, SVector<bool>* object, SVector<bool>** keys,
+            size_t n, value_type* out) const {
+        const size_t maxKeys = 64;
+        const uint64_t* data[maxKeys];
+        for (size_t i = 0; i < n; i += maxKeys) {
+            size_t count = std::min(maxKeys, n - i);
+            for (size_t j = 0; j < count; ++j) {
+                data[j] = keys[i + j]->getData();
+            }
+            HammingKernels::distances(object->getData(), data, count,
+                    object->getNumBlocks(), out + i);
+        }
+    }
+};
+
 } // namespace lmw
 
 #endif	/* DISTANCE_H */
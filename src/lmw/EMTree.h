@@ -3,7 +3,12 @@
 
 #include "StdIncludes.h"
 
+#include "BeamSearch.h"
+#include "FlatTree.h"
 #include "Node.h"
+#include "ParallelCountingSort.h"
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
 
 namespace lmw {
 
@@ -15,6 +20,7 @@ public:
     }
     
     EMTree(Node<T>* root) : _m(-1), _root(root) {
+        _root->refreshAggregates();
     }    
     
     ~EMTree() {
@@ -26,7 +32,7 @@ public:
     }
 
     uint64_t getObjCount() {
-        return objCount(_root);
+        return _root->getObjCount();
     }
 
     int getLevelCount() {
@@ -53,22 +59,37 @@ public:
         seed(data, splits);
     }
 
+    /**
+     * Seed with mini-batch k-means, see KMeans::setMiniBatch(). Nodes with
+     * more than batchSize vectors run one epoch of batches, sampling as many
+     * vectors as the node has, instead of one k-means iteration.
+     */
+    void setSeedMiniBatch(size_t batchSize) {
+        _seedMiniBatchSize = batchSize;
+    }
+
     void seed(vector<T*> &data, deque<int> splits, bool updateMeans = true) {
         CLUSTERER clusterer(_m);
+        clusterer.setMiniBatch(_seedMiniBatchSize);
         _root->addAll(data);
-        if (updateMeans) {
-            clusterer.setMaxIters(1);
-        } else {
-            clusterer.setMaxIters(0);
-        }
-        seed(_root, splits, clusterer);
+        seed(_root, splits, clusterer, updateMeans);
+        _root->refreshAggregates();
     }
     
-    void seed(Node<T>* current, deque<int> splits, CLUSTERER& clusterer) {
+    void seed(Node<T>* current, deque<int> splits, CLUSTERER& clusterer,
+            bool updateMeans) {
         if (splits.empty()) {
             return;
         } else {
             clusterer.setNumClusters(splits[0]);
+            if (!updateMeans) {
+                clusterer.setMaxIters(0);
+            } else if (_seedMiniBatchSize > 0 && size_t(current->size()) > _seedMiniBatchSize) {
+                // one epoch, see KMeans::setMiniBatch()
+                clusterer.setMaxIters(-1);
+            } else {
+                clusterer.setMaxIters(1);
+            }
             vector<Cluster<T>*> clusters = clusterer.cluster(current->getKeys());
             current->clearKeysAndChildren();
             for (Cluster<T>* c : clusters) {
@@ -79,7 +100,7 @@ public:
             current->setOwnsKeys(true);
             splits.pop_front();
             for (Node<T>* n : current->getChildren()) {
-                seed(n, splits, clusterer);
+                seed(n, splits, clusterer, updateMeans);
             }
         }   
     }
@@ -128,20 +149,14 @@ public:
     void replace(vector<T*> &data) {
         removeData(_root, removed);
         removed.clear();
-        for (T* vector : data) {
-            pushDownNoUpdate(_root, vector);
-        }
+        pushDownNoUpdate(data);
     }
 
     
     void rearrange() {
 
         removeData(_root, removed);
-
-        for (int i = 0; i < removed.size(); i++) {
-            pushDownNoUpdate(_root, removed[i]);
-        }
-
+        pushDownNoUpdate(removed);
         removed.clear();
     }
 
@@ -162,12 +177,40 @@ public:
     }
 
     void rebuildInternal() {
-        // rebuild starting with above leaf level (bottom up)
-        // we are rebuilding means in internal nodes only, this is why we start 
-        // with the above leaf level
-        for (int depth = getLevelCount() - 1; depth >= 1; --depth) {
-            rebuildInternal(_root, depth);
-        }
+        // rebuild bottom up, we are rebuilding means in internal nodes only
+        rebuildInternal(_root);
+    }
+
+    /**
+     * A FlatTree snapshot of the tree for fast queries. The leaf keys are
+     * copies of the data vectors, and their sources are the vectors. The
+     * counts and errors of internal keys are those of their subtrees. The
+     * caller deletes the snapshot.
+     */
+    FlatTree<T>* freeze() {
+        // fill the cached errors recorded by the snapshot
+        sumSquaredError(NULL, _root);
+        return new FlatTree<T>(_root);
+    }
+
+    /**
+     * Searches the tree with BeamSearch. The neighbours are the data vectors
+     * in the leaves.
+     */
+    vector<Neighbour<T> > search(T* query, int k, int beamWidth) {
+        BeamSearch<T, typename OPTIMIZER::distance_type> beamSearch(k, beamWidth);
+        vector<Neighbour<T> > neighbours;
+        beamSearch.search(_root, query, neighbours);
+        return neighbours;
+    }
+
+    /**
+     * Searches for all queries in parallel.
+     */
+    void search(vector<T*>& queries, int k, int beamWidth,
+            vector<vector<Neighbour<T> > >& neighbours) {
+        BeamSearch<T, typename OPTIMIZER::distance_type> beamSearch(k, beamWidth);
+        beamSearch.search(_root, queries, neighbours);
     }
 
     double getRMSE() {
@@ -183,7 +226,11 @@ private:
         return sqrt(SSE / size);
     }
 
+    // The result is cached in child until the tree changes.
     double sumSquaredError(T* parentKey, Node<T> *child) {
+        if (child->hasSumSquaredError()) {
+            return child->getSumSquaredError();
+        }
         double distance = 0.0;
         if (child->isLeaf()) {
             if (parentKey) { // NULL if root node is leaf
@@ -196,23 +243,10 @@ private:
                 distance += sumSquaredError(keys[i], children[i]);
             }
         }
+        child->setSumSquaredError(distance);
         return distance;
     }
 
-    uint64_t objCount(Node<T>* current) {
-        if (current->isLeaf()) {
-            return current->size();
-        } else {
-            uint64_t localCount = 0;
-            vector<Node<T>*>& children = current->getChildren();
-            for (Node<T> *child : children) {
-                localCount += objCount(child);
-
-            }
-            return localCount;
-        }
-    }
-
     int clusterCount(Node<T>* current) {
         if (current->isLeaf()) {
             if (current->isEmpty()) {
@@ -270,6 +304,9 @@ private:
         }
     }
 
+    /**
+     * Only empty subtrees are removed, so the object counts do not change.
+     */
     int prune(Node<T>* n) {
         if (n->isLeaf()) {
             return 0; // non-empty leaf node
@@ -289,23 +326,29 @@ private:
         }
     }
 
-    void rebuildInternal(Node<T> *n, int depth) {
+    /**
+     * Rebuilds the keys of n in post order, so the keys of a child are rebuilt
+     * before they are used to update the key that points to it. Subtrees are
+     * rebuilt in parallel. The object count of every node is refreshed on the
+     * way up and used to weight the prototype updates.
+     */
+    void rebuildInternal(Node<T> *n) {
+        n->invalidateSumSquaredError();
         if (n->isLeaf()) {
+            n->setObjCount(n->size());
             return;
         }
         vector<Node<T>*> &children = n->getChildren();
-        if (depth == 1) {
-            vector<T*> &keys = n->getKeys();
-            for (int i = 0; i < children.size(); ++i) {
-                Node<T>* child = children[i];
-                T* key = keys[i];
-                updatePrototype(child, key);
-            }
-        } else {
-            for (int i = 0; i < children.size(); ++i) {
-                rebuildInternal(children[i], depth - 1);
-            }
+        vector<T*> &keys = n->getKeys();
+        tbb::parallel_for(size_t(0), children.size(), [&](size_t i) {
+            rebuildInternal(children[i]);
+            updatePrototype(children[i], keys[i]);
+        });
+        uint64_t count = 0;
+        for (Node<T>* child : children) {
+            count += child->getObjCount();
         }
+        n->setObjCount(count);
     }
 
     Node<T>* nearestChild(Node<T>* n, T* vec) {
@@ -315,16 +358,97 @@ private:
         return children[nearest.index];
     }
 
-    void pushDownNoUpdate(Node<T> *n, T *vec) {
+    /**
+     * Pushes data down to the nearest leaves in parallel.
+     * 
+     * The nearest leaf of every vector is found with tbb::parallel_for, and
+     * then the vectors are scattered into the leaves with a parallel counting
+     * sort. Each leaf receives its vectors in the same order as they appear in
+     * data, so the result is the same as pushing them down one at a time.
+     */
+    void pushDownNoUpdate(vector<T*>& data) {
+        vector<Node<T>*> leaves;
+        unordered_map<Node<T>*, uint32_t> leafIndex;
+        collectLeaves(_root, leaves, leafIndex);
+
+        vector<uint32_t> nearestLeaf(data.size());
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, data.size(), 1024),
+                [&](const tbb::blocked_range<size_t>& r) {
+                    // descend in chunks that fit in cache
+                    const size_t chunkSize = 1024;
+                    vector<size_t> positions;
+                    for (size_t i = r.begin(); i < r.end(); i += chunkSize) {
+                        size_t end = std::min(r.end(), i + chunkSize);
+                        positions.resize(end - i);
+                        std::iota(positions.begin(), positions.end(), i);
+                        nearestLeaves(_root, data, positions, leafIndex, nearestLeaf);
+                    }
+                }
+        );
+
+        vector<T*> sorted(data.size());
+        vector<size_t> offsets(leaves.size() + 1);
+        if (!data.empty()) {
+            ParallelCountingSort::sort(&data[0], &nearestLeaf[0], data.size(),
+                    leaves.size(), &sorted[0], &offsets[0]);
+        }
+        tbb::parallel_for(size_t(0), leaves.size(), [&](size_t i) {
+            vector<T*>& keys = leaves[i]->getKeys();
+            keys.insert(keys.end(), sorted.begin() + offsets[i], sorted.begin() + offsets[i + 1]);
+        });
+        _root->refreshAggregates();
+    }
+
+    void collectLeaves(Node<T>* n, vector<Node<T>*>& leaves,
+            unordered_map<Node<T>*, uint32_t>& leafIndex) {
         if (n->isLeaf()) {
-            n->add(vec); // Finished
-        } else { // It is an internal node.
-            // recurse via nearest neighbor cluster
-            pushDownNoUpdate(nearestChild(n, vec), vec);
+            leafIndex[n] = leaves.size();
+            leaves.push_back(n);
+        } else {
+            for (Node<T>* child : n->getChildren()) {
+                collectLeaves(child, leaves, leafIndex);
+            }
         }
     }
-    
+
+    /**
+     * Finds the nearest leaf for data[i] for every i in positions one level at
+     * a time. The nearest child for all vectors arriving at a node is found in
+     * a single batch.
+     */
+    void nearestLeaves(Node<T>* n, vector<T*>& data, vector<size_t>& positions,
+            unordered_map<Node<T>*, uint32_t>& leafIndex, vector<uint32_t>& nearestLeaf) {
+        if (n->isLeaf()) {
+            uint32_t leaf = leafIndex.find(n)->second;
+            for (size_t i : positions) {
+                nearestLeaf[i] = leaf;
+            }
+        } else {
+            vector<T*> queries(positions.size());
+            for (size_t i = 0; i < positions.size(); ++i) {
+                queries[i] = data[positions[i]];
+            }
+            vector<Nearest<T>> nearest;
+            _optimizer.nearestBatch(queries, n->getKeys(), nearest);
+            vector<vector<size_t>> partitions(n->size());
+            for (size_t i = 0; i < positions.size(); ++i) {
+                partitions[nearest[i].index].push_back(positions[i]);
+            }
+            for (size_t i = 0; i < partitions.size(); ++i) {
+                if (!partitions[i].empty()) {
+                    nearestLeaves(n->getChild(i), data, partitions[i], leafIndex, nearestLeaf);
+                }
+            }
+        }
+    }
+
+    /**
+     * Adds child below n at depth. The objects of child are counted in the
+     * nodes along the path.
+     */
     void pushDownNoUpdateInternal(Node<T> *n, T* key, Node<T>* child, int depth) {
+        n->setObjCount(n->getObjCount() + child->getObjCount());
+        n->invalidateSumSquaredError();
         if (depth == 1) {
             n->add(key, child); // Finished
         } else { // It is an internal node.
@@ -334,18 +458,21 @@ private:
     }    
 
     // Update the protype parentKey
+    // pre: the object counts of the children of child are up to date
     void updatePrototype(Node<T> *child, T* parentKey) {
-        weights.clear();
+        vector<int> weights;
         if (!child->isLeaf()) {
             vector<Node<T>*>& children = child->getChildren();
             for (size_t i = 0; i < children.size(); i++) {
-                weights.push_back(objCount(children[i]));
+                weights.push_back(children[i]->getObjCount());
             }
         }
         _optimizer.updatePrototype(parentKey, child->getKeys(), weights);
     }
 
     void removeData(Node<T> *n, vector<T*> &data) {
+        n->setObjCount(0);
+        n->invalidateSumSquaredError();
         if (n->isLeaf()) {
             n->removeData(data);
         } else {
@@ -357,14 +484,24 @@ private:
         }
     }
     
-    void removeDataInternal(Node<T>* n, vector<T*>& keys, vector<Node<T>*>& children, int depth) {
+    /**
+     * Removes the keys and children of the nodes at depth below n and returns
+     * the number of objects below them, which is subtracted from the counts
+     * of the nodes along the way.
+     */
+    uint64_t removeDataInternal(Node<T>* n, vector<T*>& keys, vector<Node<T>*>& children, int depth) {
+        uint64_t removedCount = 0;
         if (depth == 1) {
+            removedCount = n->getObjCount();
             n->removeData(keys, children);
         } else {
             for (Node<T>* child : n->getChildren()) {
-                removeDataInternal(child, keys, children, depth - 1);
+                removedCount += removeDataInternal(child, keys, children, depth - 1);
             }
         }
+        n->setObjCount(n->getObjCount() - removedCount);
+        n->invalidateSumSquaredError();
+        return removedCount;
     }
     
     // The order of this tree
@@ -375,11 +512,11 @@ private:
 
     OPTIMIZER _optimizer;
 
+    // Vectors per batch for mini-batch k-means when seeding, 0 if not used
+    size_t _seedMiniBatchSize = 0;
+
     vector<T*> removed;
     vector<Node<T>*> removedChildren;
-
-    // Weights for prototype function (we don't have to use these)
-    vector<int> weights;    
 };
 
 } // namespace lmw
@@ -0,0 +1,660 @@
+#ifndef FLATTREE_H
+#define	FLATTREE_H
+
+#include "StdIncludes.h"
+#include "BeamSearch.h"
+#include "Distance.h"
+#include "Node.h"
+#include "Optimizer.h"
+#include "SignatureMatrix.h"
+#include "SVector.h"
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace lmw {
+
+/**
+ * A FlatTree is a read-only snapshot of an m-way tree of bit vector keys. It
+ * makes repeated descents cheaper than following Node pointers.
+ *
+ * The nodes are stored in breadth-first order in one array. The keys of
+ * every node are copied into consecutive rows of a SignatureMatrix, in the
+ * same order. So the keys of a node are adjacent in memory and scanned
+ * without chasing pointers. In breadth-first order the children of a node
+ * are also consecutive, so a node only stores the index of its first child.
+ * Keys and nodes are indexed with 32-bit integers.
+ *
+ * Each row remembers the KEY it was copied from, which is returned by
+ * nearest key lookups and searches. For EMTree and KTree the leaf keys are
+ * the data vectors, and for StreamingEMTree they are its AccumulatorKeys.
+ *
+ * Each row also records the number of objects in the cluster of the key and
+ * their sum of squared errors. By default they are taken from the child
+ * nodes, and a leaf key counts as one object with no error.
+ *
+ * The snapshot does not change when the tree does. It must be taken again
+ * after the keys or structure of the tree change.
+ *
+ * A snapshot can be written to a file with write(), and a FlatTree<SVector<
+ * bool> > constructed from the file maps it into memory instead of reading
+ * it, so a large tree is available for assignment or search at once. The
+ * sources of a loaded tree are its own keys. See FileHeader for the format.
+ *
+ * For example,
+ *      FlatTree<SVector<bool> >* flat = emtree.freeze();
+ *      vector<Neighbour<SVector<bool> > > neighbours;
+ *      flat->search(query, 10, 4, neighbours);
+ *      flat->write("emtree.bin");
+ *
+ *      FlatTree<SVector<bool> > loaded("emtree.bin");
+ *      loaded.search(query, 10, 4, neighbours);
+ */
+template <typename KEY>
+class FlatTree {
+public:
+    static const uint32_t LEAF = 0xFFFFFFFF;
+    static const uint32_t VERSION = 1;
+
+    struct FlatNode {
+        // The row of the first key
+        uint32_t firstKey;
+
+        // The number of keys
+        uint32_t size;
+
+        // The node of the first key's child, or LEAF
+        uint32_t firstChild;
+
+        bool isLeaf() const {
+            return firstChild == LEAF;
+        }
+    };
+
+    /**
+     * A file starts with this header, followed by
+     *      numNodes FlatNodes in breadth-first order,
+     *      numKeys uint64_t object counts,
+     *      numKeys double sums of squared errors,
+     *      zero padding up to keysOffset,
+     *      numKeys keys of stride blocks each, starting at keysOffset.
+     * keysOffset is a multiple of the cache line size, so the keys of a
+     * mapped file are aligned as in a SignatureMatrix. All values are in the
+     * byte order of the machine that wrote the file.
+     */
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t signatureLength; // in bits
+        uint64_t numNodes;
+        uint64_t numKeys;
+        uint64_t stride; // blocks per key including padding
+        uint64_t keysOffset; // in bytes from the start of the file
+        uint64_t reserved[2];
+    };
+
+    /**
+     * Freezes a tree whose keys are bit vectors.
+     */
+    explicit FlatTree(Node<KEY>* root) : _keys(NULL), _map(NULL), _mapSize(0) {
+        DefaultAccessor accessor;
+        NodeStatistics statistics;
+        freeze(root, accessor, statistics);
+    }
+
+    /**
+     * An ACCESSOR functor implements SVector<bool>* operator()(KEY* key) for
+     * trees with more complex keys, as in Optimizer::nearest().
+     */
+    template <typename ACCESSOR>
+    FlatTree(Node<KEY>* root, ACCESSOR& accessor) : _keys(NULL), _map(NULL), _mapSize(0) {
+        NodeStatistics statistics;
+        freeze(root, accessor, statistics);
+    }
+
+    /**
+     * A STATISTICS functor implements
+     *      void operator()(Node<KEY>* node, size_t i, uint64_t& count, double& SSE)
+     * and sets the object count and sum of squared errors of key i in node.
+     */
+    template <typename ACCESSOR, typename STATISTICS>
+    FlatTree(Node<KEY>* root, ACCESSOR& accessor, STATISTICS& statistics) :
+            _keys(NULL), _map(NULL), _mapSize(0) {
+        freeze(root, accessor, statistics);
+    }
+
+    /**
+     * Maps a file written by write(). Only a FlatTree<SVector<bool> > can be
+     * loaded. The file must not change while it is mapped.
+     */
+    explicit FlatTree(const string& file) : _keys(NULL), _map(NULL), _mapSize(0) {
+        load(file);
+        _sources.assign(_rows.begin(), _rows.end());
+    }
+
+    ~FlatTree() {
+        if (_map) {
+            for (SVector<bool>* view : _rows) {
+                delete view;
+            }
+            munmap(_map, _mapSize);
+        }
+        delete _keys;
+    }
+
+    /**
+     * Writes the snapshot to file, replacing it.
+     */
+    void write(const string& file) {
+        std::ofstream out(file.c_str(), std::ios::binary | std::ios::trunc);
+        if (!out) {
+            throw runtime_error("failed to open " + file);
+        }
+        write(out);
+        out.close();
+        if (!out) {
+            throw runtime_error("failed to write " + file);
+        }
+    }
+
+    /**
+     * Writes the snapshot at the position of out. It takes getFileSize()
+     * bytes, and anything written after it is ignored when it is loaded.
+     */
+    void write(std::ostream& out) {
+        FileHeader header;
+        memset(&header, 0, sizeof (header));
+        memcpy(header.magic, MAGIC, sizeof (header.magic));
+        header.version = VERSION;
+        header.signatureLength = _signatureLength;
+        header.numNodes = _nodes.size();
+        header.numKeys = _rows.size();
+        header.stride = _stride;
+        header.keysOffset = keysOffset(header.numNodes, header.numKeys);
+
+        out.write(reinterpret_cast<const char*>(&header), sizeof (header));
+        writeArray(out, _nodes);
+        writeArray(out, _counts);
+        writeArray(out, _sumSquaredErrors);
+        size_t written = sizeof (header) + _nodes.size() * sizeof (FlatNode)
+                + _rows.size() * (sizeof (uint64_t) + sizeof (double));
+        const char padding[SignatureMatrix::CACHE_LINE_SIZE] = {0};
+        out.write(padding, header.keysOffset - written);
+        for (SVector<bool>* row : _rows) {
+            out.write(reinterpret_cast<const char*>(row->getData()),
+                    _stride * sizeof (block_type));
+        }
+    }
+
+    /**
+     * The number of bytes written by write().
+     */
+    size_t getFileSize() const {
+        return keysOffset(_nodes.size(), _rows.size())
+                + _rows.size() * _stride * sizeof (block_type);
+    }
+
+    size_t numNodes() const {
+        return _nodes.size();
+    }
+
+    size_t numKeys() const {
+        return _rows.size();
+    }
+
+    /**
+     * The root is node 0.
+     */
+    const FlatNode& getNode(uint32_t i) const {
+        return _nodes[i];
+    }
+
+    SVector<bool>* getKey(uint32_t row) {
+        return _rows[row];
+    }
+
+    KEY* getSource(uint32_t row) {
+        return _sources[row];
+    }
+
+    /**
+     * The number of objects in the cluster of the key in row.
+     */
+    uint64_t getCount(uint32_t row) const {
+        return _counts[row];
+    }
+
+    /**
+     * The sum of squared errors of the cluster of the key in row.
+     */
+    double getSumSquaredError(uint32_t row) const {
+        return _sumSquaredErrors[row];
+    }
+
+    size_t getSignatureLength() const {
+        return _signatureLength;
+    }
+
+    /**
+     * The node of the child of the key in row of node.
+     */
+    uint32_t getChild(const FlatNode& node, uint32_t row) const {
+        return node.firstChild + (row - node.firstKey);
+    }
+
+    /**
+     * The nearest key of a node. Ties keep the earlier key, as in
+     * Optimizer::nearest(). Its index is the row of the key.
+     * pre: the node is not empty
+     */
+    Nearest<KEY> nearestKey(SVector<bool>* object, uint32_t node) {
+        const FlatNode& n = _nodes[node];
+        Batch batch;
+        hammingDistance distance;
+        value_type distances[KEY_TILE];
+        uint32_t nearestRow = n.firstKey;
+        value_type nearestDistance = 0;
+        for (uint32_t k = 0; k < n.size; k += KEY_TILE) {
+            uint32_t count = std::min(uint32_t(KEY_TILE), n.size - k);
+            batch(distance, object, keys(n.firstKey + k), count, distances);
+            for (uint32_t i = 0; i < count; ++i) {
+                if ((k == 0 && i == 0) || distances[i] < nearestDistance) {
+                    nearestDistance = distances[i];
+                    nearestRow = n.firstKey + k + i;
+                }
+            }
+        }
+        return {_sources[nearestRow], nearestRow, double(nearestDistance)};
+    }
+
+    /**
+     * Descends to the nearest leaf key, following the nearest key at each
+     * level.
+     * pre: the tree is not empty
+     */
+    Nearest<KEY> nearestLeafKey(SVector<bool>* object) {
+        uint32_t node = 0;
+        for (;;) {
+            Nearest<KEY> nearest = nearestKey(object, node);
+            const FlatNode& n = _nodes[node];
+            if (n.isLeaf()) {
+                return nearest;
+            }
+            node = getChild(n, nearest.index);
+        }
+    }
+
+    /**
+     * Finds the nearest leaf key of every vector in data, so that out[i] is
+     * the same as nearestLeafKey(data[i]).
+     *
+     * The vectors are pushed down one level at a time. At each node a block
+     * of QUERY_TILE vectors is compared with a tile of KEY_TILE keys before
+     * moving to the next tile, as in Optimizer::nearestBatch().
+     * pre: the tree is not empty
+     */
+    void nearestLeafKeys(vector<SVector<bool>*>& data, vector<Nearest<KEY> >& out) {
+        out.resize(data.size());
+        vector<uint32_t> positions(data.size());
+        for (size_t i = 0; i < positions.size(); ++i) {
+            positions[i] = i;
+        }
+        if (!data.empty()) {
+            nearestLeafKeys(0, data, positions, out);
+        }
+    }
+
+    /**
+     * Searches the snapshot the same way as BeamSearch. The objects of the
+     * neighbours are the source keys of the leaves.
+     */
+    void search(SVector<bool>* query, int k, int beamWidth,
+            vector<Neighbour<KEY> >& neighbours) {
+        neighbours.clear();
+        if (_sources.empty()) {
+            return;
+        }
+        vector<value_type> distances;
+        vector<uint32_t> beam(1, 0);
+        vector<uint32_t> leaves;
+        vector<std::pair<value_type, uint32_t> > candidates;
+        vector<uint32_t> order;
+        while (!beam.empty()) {
+            candidates.clear();
+            for (uint32_t node : beam) {
+                const FlatNode& n = _nodes[node];
+                if (n.isLeaf()) {
+                    leaves.push_back(node);
+                    continue;
+                }
+                nodeDistances(query, n, distances);
+                for (uint32_t i = 0; i < n.size; ++i) {
+                    candidates.push_back(std::make_pair(distances[i], n.firstChild + i));
+                }
+            }
+            size_t count = best(candidates, beamWidth, order,
+                    [](const std::pair<value_type, uint32_t>& c) {
+                        return c.first;
+                    });
+            beam.clear();
+            for (size_t i = 0; i < count; ++i) {
+                beam.push_back(candidates[order[i]].second);
+            }
+        }
+
+        for (uint32_t node : leaves) {
+            const FlatNode& n = _nodes[node];
+            nodeDistances(query, n, distances);
+            for (uint32_t i = 0; i < n.size; ++i) {
+                neighbours.push_back({_sources[n.firstKey + i], double(distances[i])});
+            }
+        }
+        size_t count = best(neighbours, k, order,
+                [](const Neighbour<KEY>& n) {
+                    return n.distance;
+                });
+        vector<Neighbour<KEY> > nearest;
+        nearest.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            nearest.push_back(neighbours[order[i]]);
+        }
+        neighbours.swap(nearest);
+    }
+
+    /**
+     * Searches for all queries in parallel.
+     */
+    void search(vector<SVector<bool>*>& queries, int k, int beamWidth,
+            vector<vector<Neighbour<KEY> > >& neighbours) {
+        neighbours.resize(queries.size());
+        tbb::parallel_for(size_t(0), queries.size(), [&](size_t i) {
+            search(queries[i], k, beamWidth, neighbours[i]);
+        });
+    }
+
+private:
+    /**
+     * Sorts the positions of the n nearest of items to the front of order,
+     * with ties in their order, as BeamSearch does, and returns how many
+     * there are. DISTANCE returns the distance of an item.
+     */
+    template <typename ITEM, typename DISTANCE>
+    static size_t best(vector<ITEM>& items, int n, vector<uint32_t>& order,
+            DISTANCE distance) {
+        size_t count = std::min(items.size(), size_t(std::max(n, 0)));
+        order.resize(items.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        std::partial_sort(order.begin(), order.begin() + count, order.end(),
+                [&items, &distance](uint32_t a, uint32_t b) {
+                    return distance(items[a]) < distance(items[b])
+                            || (distance(items[a]) == distance(items[b]) && a < b);
+                });
+        return count;
+    }
+
+    FlatTree(const FlatTree&) = delete;
+    FlatTree& operator=(const FlatTree&) = delete;
+
+    static const size_t QUERY_TILE = 16;
+    static const size_t KEY_TILE = 64;
+    static constexpr const char* MAGIC = "LMWFLAT";
+
+    typedef DistanceBatch<SVector<bool>, hammingDistance> Batch;
+    typedef Batch::value_type value_type;
+
+    struct DefaultAccessor {
+        SVector<bool>* operator()(SVector<bool>* key) {
+            return key;
+        }
+    };
+
+    /**
+     * Uses the counts and errors cached in the children. A leaf key is one
+     * object.
+     */
+    struct NodeStatistics {
+        void operator()(Node<KEY>* node, size_t i, uint64_t& count, double& SSE) {
+            if (node->isLeaf()) {
+                count = 1;
+                SSE = 0;
+            } else {
+                Node<KEY>* child = node->getChild(i);
+                count = child->getObjCount();
+                SSE = child->hasSumSquaredError() ? child->getSumSquaredError() : 0;
+            }
+        }
+    };
+
+    template <typename ACCESSOR, typename STATISTICS>
+    void freeze(Node<KEY>* root, ACCESSOR& accessor, STATISTICS& statistics) {
+        // breadth-first order of the nodes
+        vector<Node<KEY>*> order(1, root);
+        size_t numKeys = 0;
+        for (size_t i = 0; i < order.size(); ++i) {
+            Node<KEY>* n = order[i];
+            numKeys += n->size();
+            if (!n->isLeaf()) {
+                vector<Node<KEY>*>& children = n->getChildren();
+                order.insert(order.end(), children.begin(), children.end());
+            }
+        }
+        if (numKeys >= LEAF || order.size() >= LEAF) {
+            throw runtime_error("tree is too large to freeze");
+        }
+
+        size_t length = numKeys > 0 ? accessor(root->getKey(0))->size() : W_SIZE;
+        _keys = new SignatureMatrix(numKeys, length);
+        _signatureLength = length;
+        _stride = _keys->getStride();
+        _sources.reserve(numKeys);
+        _counts.resize(numKeys);
+        _sumSquaredErrors.resize(numKeys);
+        _nodes.resize(order.size());
+        uint32_t nextChild = 1;
+        for (size_t i = 0; i < order.size(); ++i) {
+            Node<KEY>* n = order[i];
+            FlatNode& flat = _nodes[i];
+            flat.firstKey = _sources.size();
+            flat.size = n->size();
+            if (n->isLeaf()) {
+                flat.firstChild = LEAF;
+            } else {
+                flat.firstChild = nextChild;
+                nextChild += n->size();
+            }
+            for (size_t j = 0; j < size_t(n->size()); ++j) {
+                KEY* key = n->getKey(j);
+                SVector<bool>* row = _keys->add();
+                memcpy(row->getData(), accessor(key)->getData(),
+                        _keys->getNumBlocks() * sizeof (block_type));
+                statistics(n, j, _counts[_sources.size()], _sumSquaredErrors[_sources.size()]);
+                _sources.push_back(key);
+            }
+        }
+        _rows = _keys->getVectors();
+    }
+
+    static uint64_t keysOffset(uint64_t numNodes, uint64_t numKeys) {
+        const uint64_t line = SignatureMatrix::CACHE_LINE_SIZE;
+        uint64_t end = sizeof (FileHeader) + numNodes * sizeof (FlatNode)
+                + numKeys * (sizeof (uint64_t) + sizeof (double));
+        return ((end + line - 1) / line) * line;
+    }
+
+    template <typename ITEM>
+    static void writeArray(std::ostream& out, const vector<ITEM>& items) {
+        if (!items.empty()) {
+            out.write(reinterpret_cast<const char*>(&items[0]),
+                    items.size() * sizeof (ITEM));
+        }
+    }
+
+    /**
+     * Maps file and checks that it is a whole and consistent tree. The nodes,
+     * counts and errors are copied, and the keys are views of the mapping.
+     */
+    void load(const string& file) {
+        int fd = open(file.c_str(), O_RDONLY);
+        if (fd == -1) {
+            throw runtime_error("failed to open " + file);
+        }
+        struct stat info;
+        if (fstat(fd, &info) == -1) {
+            close(fd);
+            throw runtime_error("failed to stat " + file);
+        }
+        size_t size = info.st_size;
+        if (size < sizeof (FileHeader)) {
+            close(fd);
+            throw runtime_error(file + " is not a tree");
+        }
+        void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            throw runtime_error("failed to map " + file);
+        }
+        const char* bytes = static_cast<const char*>(data);
+        try {
+            const FileHeader& header = *reinterpret_cast<const FileHeader*>(bytes);
+            if (memcmp(header.magic, MAGIC, sizeof (header.magic)) != 0
+                    || header.version != VERSION) {
+                throw runtime_error(file + " is not a tree");
+            }
+            if (header.signatureLength % W_SIZE != 0
+                    || header.stride * W_SIZE < header.signatureLength
+                    || header.numNodes == 0 || header.numNodes >= LEAF
+                    || header.numKeys >= LEAF
+                    || header.keysOffset != keysOffset(header.numNodes, header.numKeys)
+                    || size < header.keysOffset
+                    || (size - header.keysOffset) / sizeof (block_type) / std::max(
+                    header.stride, uint64_t(1)) < header.numKeys) {
+                throw runtime_error(file + " is truncated or corrupt");
+            }
+            _signatureLength = header.signatureLength;
+            _stride = header.stride;
+            const char* cursor = bytes + sizeof (FileHeader);
+            readArray(cursor, header.numNodes, _nodes);
+            readArray(cursor, header.numKeys, _counts);
+            readArray(cursor, header.numKeys, _sumSquaredErrors);
+            for (const FlatNode& n : _nodes) {
+                if (uint64_t(n.firstKey) + n.size > header.numKeys
+                        || (!n.isLeaf() && uint64_t(n.firstChild) + n.size > header.numNodes)) {
+                    throw runtime_error(file + " is truncated or corrupt");
+                }
+            }
+        } catch (...) {
+            munmap(data, size);
+            throw;
+        }
+        _map = data;
+        _mapSize = size;
+
+        // the mapping is read only, and so are the views
+        const FileHeader& header = *reinterpret_cast<const FileHeader*>(bytes);
+        block_type* keys = reinterpret_cast<block_type*>(
+                const_cast<char*>(bytes + header.keysOffset));
+        _rows.reserve(header.numKeys);
+        for (size_t i = 0; i < header.numKeys; ++i) {
+            _rows.push_back(new SVector<bool>(keys + i * _stride, _signatureLength));
+        }
+    }
+
+    template <typename ITEM>
+    static void readArray(const char*& cursor, size_t size, vector<ITEM>& items) {
+        items.resize(size);
+        if (size > 0) {
+            memcpy(&items[0], cursor, size * sizeof (ITEM));
+        }
+        cursor += size * sizeof (ITEM);
+    }
+
+    SVector<bool>** keys(uint32_t row) {
+        return &_rows[row];
+    }
+
+    void nodeDistances(SVector<bool>* query, const FlatNode& n, vector<value_type>& distances) {
+        Batch batch;
+        hammingDistance distance;
+        distances.resize(n.size);
+        if (n.size > 0) {
+            batch(distance, query, keys(n.firstKey), n.size, &distances[0]);
+        }
+    }
+
+    void nearestLeafKeys(uint32_t node, vector<SVector<bool>*>& data,
+            vector<uint32_t>& positions, vector<Nearest<KEY> >& out) {
+        const FlatNode& n = _nodes[node];
+        if (n.size == 0) {
+            return;
+        }
+        Batch batch;
+        hammingDistance distance;
+        value_type distances[KEY_TILE];
+        value_type nearestDistance[QUERY_TILE];
+        uint32_t nearestRow[QUERY_TILE];
+        vector<vector<uint32_t> > partitions(n.isLeaf() ? 0 : n.size);
+        for (size_t q = 0; q < positions.size(); q += QUERY_TILE) {
+            size_t queryCount = std::min(QUERY_TILE, positions.size() - q);
+            for (uint32_t k = 0; k < n.size; k += KEY_TILE) {
+                uint32_t keyCount = std::min(uint32_t(KEY_TILE), n.size - k);
+                SVector<bool>** tile = keys(n.firstKey + k);
+                for (size_t j = 0; j < queryCount; ++j) {
+                    batch(distance, data[positions[q + j]], tile, keyCount, distances);
+                    for (uint32_t i = 0; i < keyCount; ++i) {
+                        // ties keep the earlier key
+                        if ((k == 0 && i == 0) || distances[i] < nearestDistance[j]) {
+                            nearestDistance[j] = distances[i];
+                            nearestRow[j] = n.firstKey + k + i;
+                        }
+                    }
+                }
+            }
+            for (size_t j = 0; j < queryCount; ++j) {
+                uint32_t row = nearestRow[j];
+                if (n.isLeaf()) {
+                    out[positions[q + j]] = {_sources[row], row, double(nearestDistance[j])};
+                } else {
+                    partitions[row - n.firstKey].push_back(positions[q + j]);
+                }
+            }
+        }
+        for (uint32_t i = 0; i < partitions.size(); ++i) {
+            if (!partitions[i].empty()) {
+                nearestLeafKeys(n.firstChild + i, data, partitions[i], out);
+            }
+        }
+    }
+
+    // Nodes in breadth-first order
+    vector<FlatNode> _nodes;
+
+    // The keys of all nodes, in the order of _nodes, unless loaded
+    SignatureMatrix* _keys;
+
+    // A view of every key, in _keys or the mapped file
+    vector<SVector<bool>*> _rows;
+
+    // The key each row was copied from
+    vector<KEY*> _sources;
+
+    // The object count and sum of squared errors of every row
+    vector<uint64_t> _counts;
+    vector<double> _sumSquaredErrors;
+
+    size_t _signatureLength; // in bits
+    size_t _stride; // blocks per key including padding
+
+    // The file a loaded tree is mapped from, or NULL
+    void* _map;
+    size_t _mapSize;
+};
+
+} // namespace lmw
+
+#endif	/* FLATTREE_H */
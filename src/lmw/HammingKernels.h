@@ -0,0 +1,304 @@
+/**
+ * This file contains the kernels that count the Hamming distance between two
+ * bit vectors stored as arrays of 64 bit blocks. This is the innermost loop of
+ * every algorithm when clustering bit vectors.
+ *
+ * Several implementations are provided and the fastest one supported by the
+ * CPU is chosen the first time a distance is calculated,
+ *      avx512  - AVX-512 VPOPCNTDQ, 8 blocks per instruction
+ *      avx2    - Harley-Seal carry save adders over 256 bit nibble lookups
+ *      popcnt  - one POPCNT instruction per block
+ *      scalar  - portable fallback, used on non x86 CPUs and other compilers
+ *
+ * Dispatch happens at runtime, so a binary built without -march=native still
+ * uses the vector instructions when they are available. All kernels return
+ * exactly the same result.
+ *
+ * For example,
+ *      int distance = HammingKernels::distance(a->getData(), b->getData(),
+ *              a->getNumBlocks());
+ */
+
+#ifndef HAMMINGKERNELS_H
+#define	HAMMINGKERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LMW_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace lmw {
+
+class HammingKernels {
+public:
+    typedef int (*Kernel)(const uint64_t*, const uint64_t*, size_t);
+
+    typedef void (*ManyKernel)(const uint64_t*, const uint64_t* const*, size_t, size_t, int*);
+
+    static int distance(const uint64_t* a, const uint64_t* b, size_t numBlocks) {
+        return kernel()(a, b, numBlocks);
+    }
+
+    /**
+     * The distance from a query to numKeys keys, out[i] = distance(query, keys[i]).
+     */
+    static void distances(const uint64_t* query, const uint64_t* const* keys,
+            size_t numKeys, size_t numBlocks, int* out) {
+        manyKernel()(query, keys, numKeys, numBlocks, out);
+    }
+
+    /**
+     * The kernel selected for this CPU. It is chosen once and then cached.
+     */
+    static Kernel kernel() {
+        static const Kernel selected = select();
+        return selected;
+    }
+
+    static ManyKernel manyKernel() {
+        static const ManyKernel selected = selectMany();
+        return selected;
+    }
+
+    static const char* kernelName() {
+        Kernel k = kernel();
+#ifdef LMW_X86_KERNELS
+        if (k == &avx512) return "avx512";
+        if (k == &avx2) return "avx2";
+        if (k == &popcnt) return "popcnt";
+#endif
+        return "scalar";
+    }
+
+    static inline int popcnt64(uint64_t b64) {
+#ifdef __GNUC__
+        // uses POPCNT instruction if available, otherwise lookup table
+        return __builtin_popcountll(b64);
+#else
+        uint64_t x(b64);
+        x = x - ((x >> 1) & 0x5555555555555555ULL);
+        x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+        x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+        x = (x * 0x0101010101010101ULL) >> 56;
+        return int(x);
+#endif
+    }
+
+    static int scalar(const uint64_t* a, const uint64_t* b, size_t numBlocks) {
+        int count = 0;
+        for (size_t i = 0; i < numBlocks; ++i) {
+            count += popcnt64(a[i] ^ b[i]);
+        }
+        return count;
+    }
+
+#ifdef LMW_X86_KERNELS
+    __attribute__((target("popcnt")))
+    static int popcnt(const uint64_t* a, const uint64_t* b, size_t numBlocks) {
+        // four independent counters hide the latency of POPCNT
+        uint64_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+        size_t i = 0;
+        for (; i + 4 <= numBlocks; i += 4) {
+            c0 += _mm_popcnt_u64(a[i] ^ b[i]);
+            c1 += _mm_popcnt_u64(a[i + 1] ^ b[i + 1]);
+            c2 += _mm_popcnt_u64(a[i + 2] ^ b[i + 2]);
+            c3 += _mm_popcnt_u64(a[i + 3] ^ b[i + 3]);
+        }
+        for (; i < numBlocks; ++i) {
+            c0 += _mm_popcnt_u64(a[i] ^ b[i]);
+        }
+        return int(c0 + c1 + c2 + c3);
+    }
+
+    /**
+     * Harley-Seal population count of a ^ b, see Mula, Kurz and Lemire,
+     * "Faster Population Counts Using AVX2 Instructions". Sixteen 256 bit
+     * words are reduced through a tree of carry save adders so that only one
+     * in sixteen words needs a full population count.
+     */
+    __attribute__((target("avx2")))
+    static int avx2(const uint64_t* a, const uint64_t* b, size_t numBlocks) {
+        const size_t words = numBlocks / 4;
+        __m256i total = _mm256_setzero_si256();
+        __m256i ones = _mm256_setzero_si256();
+        __m256i twos = _mm256_setzero_si256();
+        __m256i fours = _mm256_setzero_si256();
+        __m256i eights = _mm256_setzero_si256();
+        __m256i sixteens, twosA, twosB, foursA, foursB, eightsA, eightsB;
+        size_t i = 0;
+        for (; i + 16 <= words; i += 16) {
+            csa(&twosA, &ones, ones, load(a, b, i), load(a, b, i + 1));
+            csa(&twosB, &ones, ones, load(a, b, i + 2), load(a, b, i + 3));
+            csa(&foursA, &twos, twos, twosA, twosB);
+            csa(&twosA, &ones, ones, load(a, b, i + 4), load(a, b, i + 5));
+            csa(&twosB, &ones, ones, load(a, b, i + 6), load(a, b, i + 7));
+            csa(&foursB, &twos, twos, twosA, twosB);
+            csa(&eightsA, &fours, fours, foursA, foursB);
+            csa(&twosA, &ones, ones, load(a, b, i + 8), load(a, b, i + 9));
+            csa(&twosB, &ones, ones, load(a, b, i + 10), load(a, b, i + 11));
+            csa(&foursA, &twos, twos, twosA, twosB);
+            csa(&twosA, &ones, ones, load(a, b, i + 12), load(a, b, i + 13));
+            csa(&twosB, &ones, ones, load(a, b, i + 14), load(a, b, i + 15));
+            csa(&foursB, &twos, twos, twosA, twosB);
+            csa(&eightsB, &fours, fours, foursA, foursB);
+            csa(&sixteens, &eights, eights, eightsA, eightsB);
+            total = _mm256_add_epi64(total, popcount256(sixteens));
+        }
+        total = _mm256_slli_epi64(total, 4);
+        total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount256(eights), 3));
+        total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount256(fours), 2));
+        total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount256(twos), 1));
+        total = _mm256_add_epi64(total, popcount256(ones));
+        for (; i < words; ++i) {
+            total = _mm256_add_epi64(total, popcount256(load(a, b, i)));
+        }
+        int count = int(_mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1)
+                + _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3));
+        for (size_t j = words * 4; j < numBlocks; ++j) {
+            count += int(_mm_popcnt_u64(a[j] ^ b[j]));
+        }
+        return count;
+    }
+
+    __attribute__((target("avx512f,avx512vpopcntdq")))
+    static int avx512(const uint64_t* a, const uint64_t* b, size_t numBlocks) {
+        __m512i c0 = _mm512_setzero_si512();
+        __m512i c1 = _mm512_setzero_si512();
+        size_t i = 0;
+        for (; i + 16 <= numBlocks; i += 16) {
+            __m512i x0 = _mm512_xor_si512(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+            __m512i x1 = _mm512_xor_si512(_mm512_loadu_si512(a + i + 8), _mm512_loadu_si512(b + i + 8));
+            c0 = _mm512_add_epi64(c0, _mm512_popcnt_epi64(x0));
+            c1 = _mm512_add_epi64(c1, _mm512_popcnt_epi64(x1));
+        }
+        for (; i < numBlocks; i += 8) {
+            // masked loads handle the last partial group of 8 blocks
+            size_t remaining = numBlocks - i;
+            __mmask8 mask = remaining >= 8 ? 0xff : __mmask8((1u << remaining) - 1);
+            __m512i x = _mm512_xor_si512(_mm512_maskz_loadu_epi64(mask, a + i),
+                    _mm512_maskz_loadu_epi64(mask, b + i));
+            c0 = _mm512_add_epi64(c0, _mm512_popcnt_epi64(x));
+        }
+        return int(_mm512_reduce_add_epi64(_mm512_add_epi64(c0, c1)));
+    }
+
+    /**
+     * Compares the query against four keys at a time so that every block of
+     * the query is loaded once for four distances.
+     */
+    __attribute__((target("avx512f,avx512vpopcntdq")))
+    static void avx512Many(const uint64_t* query, const uint64_t* const* keys,
+            size_t numKeys, size_t numBlocks, int* out) {
+        const size_t full = numBlocks - numBlocks % 8;
+        const __mmask8 tail = __mmask8((1u << (numBlocks % 8)) - 1);
+        size_t j = 0;
+        for (; j + 4 <= numKeys; j += 4) {
+            const uint64_t* k0 = keys[j];
+            const uint64_t* k1 = keys[j + 1];
+            const uint64_t* k2 = keys[j + 2];
+            const uint64_t* k3 = keys[j + 3];
+            __m512i c0 = _mm512_setzero_si512();
+            __m512i c1 = _mm512_setzero_si512();
+            __m512i c2 = _mm512_setzero_si512();
+            __m512i c3 = _mm512_setzero_si512();
+            for (size_t i = 0; i < full; i += 8) {
+                __m512i q = _mm512_loadu_si512(query + i);
+                c0 = _mm512_add_epi64(c0, _mm512_popcnt_epi64(_mm512_xor_si512(q, _mm512_loadu_si512(k0 + i))));
+                c1 = _mm512_add_epi64(c1, _mm512_popcnt_epi64(_mm512_xor_si512(q, _mm512_loadu_si512(k1 + i))));
+                c2 = _mm512_add_epi64(c2, _mm512_popcnt_epi64(_mm512_xor_si512(q, _mm512_loadu_si512(k2 + i))));
+                c3 = _mm512_add_epi64(c3, _mm512_popcnt_epi64(_mm512_xor_si512(q, _mm512_loadu_si512(k3 + i))));
+            }
+            if (tail) {
+                __m512i q = _mm512_maskz_loadu_epi64(tail, query + full);
+                c0 = _mm512_add_epi64(c0, _mm512_popcnt_epi64(_mm512_xor_si512(q, _mm512_maskz_loadu_epi64(tail, k0 + full))));
+                c1 = _mm512_add_epi64(c1, _mm512_popcnt_epi64(_mm512_xor_si512(q, _mm512_maskz_loadu_epi64(tail, k1 + full))));
+                c2 = _mm512_add_epi64(c2, _mm512_popcnt_epi64(_mm512_xor_si512(q, _mm512_maskz_loadu_epi64(tail, k2 + full))));
+                c3 = _mm512_add_epi64(c3, _mm512_popcnt_epi64(_mm512_xor_si512(q, _mm512_maskz_loadu_epi64(tail, k3 + full))));
+            }
+            out[j] = int(_mm512_reduce_add_epi64(c0));
+            out[j + 1] = int(_mm512_reduce_add_epi64(c1));
+            out[j + 2] = int(_mm512_reduce_add_epi64(c2));
+            out[j + 3] = int(_mm512_reduce_add_epi64(c3));
+        }
+        for (; j < numKeys; ++j) {
+            out[j] = avx512(query, keys[j], numBlocks);
+        }
+    }
+#endif
+
+    /**
+     * One to many distances for kernels without a dedicated implementation.
+     */
+    template <Kernel K>
+    static void many(const uint64_t* query, const uint64_t* const* keys,
+            size_t numKeys, size_t numBlocks, int* out) {
+        for (size_t j = 0; j < numKeys; ++j) {
+            out[j] = K(query, keys[j], numBlocks);
+        }
+    }
+
+private:
+    static Kernel select() {
+#ifdef LMW_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq")) {
+            return &avx512;
+        }
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+            return &avx2;
+        }
+        if (__builtin_cpu_supports("popcnt")) {
+            return &popcnt;
+        }
+#endif
+        return &scalar;
+    }
+
+    static ManyKernel selectMany() {
+#ifdef LMW_X86_KERNELS
+        Kernel k = kernel();
+        if (k == &avx512) return &avx512Many;
+        if (k == &avx2) return &many<&avx2>;
+        if (k == &popcnt) return &many<&popcnt>;
+#endif
+        return &many<&scalar>;
+    }
+
+#ifdef LMW_X86_KERNELS
+    __attribute__((target("avx2")))
+    static inline __m256i load(const uint64_t* a, const uint64_t* b, size_t word) {
+        const __m256i* pa = reinterpret_cast<const __m256i*>(a) + word;
+        const __m256i* pb = reinterpret_cast<const __m256i*>(b) + word;
+        return _mm256_xor_si256(_mm256_loadu_si256(pa), _mm256_loadu_si256(pb));
+    }
+
+    // carry save adder: h:l = a + b + c
+    __attribute__((target("avx2")))
+    static inline void csa(__m256i* h, __m256i* l, __m256i a, __m256i b, __m256i c) {
+        __m256i u = _mm256_xor_si256(a, b);
+        *h = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(u, c));
+        *l = _mm256_xor_si256(u, c);
+    }
+
+    // population count of each 64 bit lane using a 4 bit lookup table
+    __attribute__((target("avx2")))
+    static inline __m256i popcount256(__m256i v) {
+        const __m256i lookup = _mm256_setr_epi8(
+                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        const __m256i low = _mm256_set1_epi8(0x0f);
+        __m256i lo = _mm256_and_si256(v, low);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+        __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+                _mm256_shuffle_epi8(lookup, hi));
+        return _mm256_sad_epu8(counts, _mm256_setzero_si256());
+    }
+#endif
+};
+
+} // namespace lmw
+
+#endif	/* HAMMINGKERNELS_H */
@@ -3,6 +3,8 @@
 
 #include "Cluster.h"
 #include "Clusterer.h"
+#include "MiniBatchAccumulator.h"
+#include "ParallelCountingSort.h"
 #include "Seeder.h"
 #include "StdIncludes.h"
 #include "tbb/atomic.h"
@@ -25,6 +27,7 @@ public:
     ~KMeans() {
         // Need to clean up any created cluster objects
         Utils::purge(_clusters);
+        Utils::purge(_previousCentroids);
     }
 
     //vector<size_t>& getNearestCentroids() {
@@ -43,6 +46,39 @@ public:
         _enforceNumClusters = enforceNumClusters;
     }
 
+    /**
+     * Skip distance calculations using the triangle inequality as in Hamerly's
+     * algorithm. Every vector keeps an upper bound on the distance to its
+     * centroid and a lower bound on the distance to all other centroids. The
+     * bounds are loosened by how far the centroids move each iteration, and a
+     * vector is only compared with all centroids when the bounds no longer
+     * prove that its centroid is strictly the nearest. The clustering is the
+     * same as without acceleration.
+     *
+     * It requires the DISTANCE to be a metric, such as the hamming distance,
+     * and the OPTIMIZER to minimize it.
+     */
+    void setAccelerated(bool accelerated) {
+        _accelerated = accelerated;
+    }
+
+    /**
+     * Use mini-batch k-means (Sculley, Web-Scale K-Means Clustering, 2010)
+     * when there are more than batchSize vectors. Each iteration assigns a
+     * random sample of batchSize vectors to their nearest centroids and adds
+     * them to the MiniBatchAccumulator of the centroid, which sums every
+     * vector the centroid has been assigned so far. The centroids are then
+     * updated from their accumulators. The maximum number of iterations is
+     * the number of batches. -1 runs until a batch changes no centroid, or
+     * until as many vectors as there are in the data have been sampled.
+     * All vectors are assigned to their nearest centroid once at the end.
+     *
+     * A batchSize of 0 turns it off.
+     */
+    void setMiniBatch(size_t batchSize) {
+        _miniBatchSize = batchSize;
+    }
+
     int numClusters() {
         return _numClusters;
     }
@@ -63,7 +99,7 @@ public:
         double SSE = 0;
         size_t objects = 0;
         for (Cluster<T>* cluster : _clusters) {
-            auto neighbours = cluster->getNearestList();
+            vector<T*>& neighbours = cluster->getNearestList();
             objects += neighbours.size();
             SSE += _optimizer.sumSquaredError(cluster->getCentroid(), neighbours);
         }
@@ -77,17 +113,18 @@ private:
         if (emptyCluster && _enforceNumClusters) {
             // randomly shuffle if k cluster were not created to enforce the number of clusters if required
             //std::cout << std::endl << "k-means is splitting randomly";
+            _finalClusters.clear();
             vector<T*> shuffled(data);
             std::random_shuffle(shuffled.begin(), shuffled.end());
-            {
-                size_t step = shuffled.size(), i = 0, clusterIndex = 0;
-                for (; i < shuffled.size(); i += step, ++clusterIndex) {
-                    for (size_t j = i; j < i + step && j < shuffled.size(); ++j) {
-                        _nearestCentroid[j] = clusterIndex;
-                    }
-                }
+            for (Cluster<T>* c : _clusters) {
+                c->clearNearest();
             }
-            vectorsToNearestCentroid(data);
+            // deal round robin so every cluster gets an object when there are
+            // at least as many objects as clusters
+            for (size_t i = 0; i < shuffled.size(); ++i) {
+                _clusters[i % _clusters.size()]->addNearest(shuffled[i]);
+            }
+            _boundsValid = false;
             recalculateCentroids(data);
             assignClusters(data);
         }
@@ -115,6 +152,7 @@ private:
         _iterCount = 0;
         _numClusters = clusters;
         _nearestCentroid.resize(data.size());
+        _boundsValid = false;
         _seeder->seed(data, _centroids, _numClusters);
 
         // Create as many cluster objects as there are centroids
@@ -122,6 +160,12 @@ private:
             _clusters.push_back(new Cluster<T>(c));
         }
 
+        if (_miniBatchSize > 0 && _miniBatchSize < data.size() && _maxIters != 0) {
+            miniBatch(data);
+            vectorsToNearestCentroid(data);
+            return;
+        }
+
         // First iteration
         vectorsToNearestCentroid(data);
         if (_maxIters == 0) {
@@ -154,6 +198,57 @@ private:
         }
     }
 
+    /**
+     * Runs the batches of mini-batch k-means. See setMiniBatch().
+     */
+    void miniBatch(vector<T*> &data) {
+        const size_t k = _centroids.size();
+        vector<MiniBatchAccumulator<T>*> accumulators;
+        for (T* centroid : _centroids) {
+            accumulators.push_back(new MiniBatchAccumulator<T>(centroid));
+        }
+        RND_ENG eng(std::rand()); // seeded with srand() like the seeders
+        vector<T*> batch(_miniBatchSize);
+        vector<size_t> nearestCentroid(_miniBatchSize);
+        vector<T*> members(_miniBatchSize);
+        vector<size_t> offsets(k + 1);
+        int maxIters = _maxIters;
+        if (maxIters == -1) {
+            maxIters = (data.size() + _miniBatchSize - 1) / _miniBatchSize;
+        }
+        for (_iterCount = 0; _iterCount < maxIters; ++_iterCount) {
+            for (size_t i = 0; i < _miniBatchSize; ++i) {
+                batch[i] = data[eng() % data.size()];
+            }
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, batch.size(), 1000),
+                    [&](const tbb::blocked_range<size_t>& r) {
+                        vector<Nearest<T>> nearest(r.size());
+                        _optimizer.nearestBatch(&batch[r.begin()], r.size(), _centroids, &nearest[0]);
+                        for (size_t i = r.begin(); i != r.end(); ++i) {
+                            nearestCentroid[i] = nearest[i - r.begin()].index;
+                        }
+                    }
+            );
+            ParallelCountingSort::sort(&batch[0], &nearestCentroid[0], batch.size(), k,
+                    &members[0], &offsets[0]);
+            _converged = true;
+            tbb::parallel_for(size_t(0), k, [&](size_t c) {
+                size_t count = offsets[c + 1] - offsets[c];
+                if (count == 0) {
+                    return;
+                }
+                accumulators[c]->add(&members[offsets[c]], count);
+                if (accumulators[c]->update(_centroids[c])) {
+                    _converged = false;
+                }
+            });
+            if (_converged) {
+                break;
+            }
+        }
+        Utils::purge(accumulators);
+    }
+
     /**
      * Assign vectors to nearest centroid.
      * Pre: seedCentroids() OR recalculateCentroids() has been called
@@ -171,32 +266,148 @@ private:
         _converged = true;
 
         // Parallel
+        if (_accelerated) {
+            acceleratedNearestCentroid(data);
+        } else {
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, data.size(), 1000),
+                    [&](const tbb::blocked_range<size_t>& r) {
+                        vector<Nearest<T>> nearest(r.size());
+                        _optimizer.nearestBatch(&data[r.begin()], r.size(), _centroids, &nearest[0]);
+                        for (size_t i = r.begin(); i != r.end(); ++i) {
+                            size_t index = nearest[i - r.begin()].index;
+                            if (index != _nearestCentroid[i]) {
+                                _converged = false;
+                            }
+                            _nearestCentroid[i] = index;
+                        }
+                    }
+            );
+        }
+        tbb::atomic_fence(); // make sure all writes are visible on all CPUs
+
+        // Group the vectors by cluster so each cluster is contiguous in
+        // _members, keeping the order of data within a cluster.
+        _members.resize(data.size());
+        _offsets.resize(_clusters.size() + 1);
+        if (!data.empty()) {
+            ParallelCountingSort::sort(&data[0], &_nearestCentroid[0], data.size(),
+                    _clusters.size(), &_members[0], &_offsets[0]);
+        } else {
+            std::fill(_offsets.begin(), _offsets.end(), 0);
+        }
+
+        // Accumlate into clusters
+        tbb::parallel_for(size_t(0), _clusters.size(), [&](size_t c) {
+            T** members = _members.empty() ? NULL : &_members[0];
+            _clusters[c]->setNearest(members + _offsets[c], members + _offsets[c + 1]);
+        });
+    }
+
+    /**
+     * Hamerly's algorithm for the parallel part of vectorsToNearestCentroid().
+     * When the bounds are not valid, for example, after seeding, every vector
+     * is compared with all centroids to initialize them.
+     */
+    void acceleratedNearestCentroid(vector<T*> &data) {
+        const size_t k = _centroids.size();
+        _upper.resize(data.size());
+        _lower.resize(data.size());
+
+        // How far each centroid moved since the bounds were last updated.
+        vector<double> drift(k, 0);
+        double maxDrift = 0, secondDrift = 0;
+        size_t maxDriftIndex = 0;
+        if (_boundsValid) {
+            for (size_t c = 0; c < k; ++c) {
+                drift[c] = _optimizer.distance(_previousCentroids[c], _centroids[c]);
+                if (drift[c] > maxDrift) {
+                    secondDrift = maxDrift;
+                    maxDrift = drift[c];
+                    maxDriftIndex = c;
+                } else if (drift[c] > secondDrift) {
+                    secondDrift = drift[c];
+                }
+            }
+        }
+
+        // Half the distance from each centroid to the nearest other centroid.
+        // Any vector closer than this to its centroid can not be nearer
+        // another centroid.
+        vector<double> halfSeparation(k, std::numeric_limits<double>::max());
+        tbb::parallel_for(size_t(0), k, [&](size_t c) {
+            for (size_t j = 0; j < k; ++j) {
+                if (j != c) {
+                    double half = _optimizer.distance(_centroids[c], _centroids[j]) / 2;
+                    halfSeparation[c] = std::min(halfSeparation[c], half);
+                }
+            }
+        });
+
         tbb::parallel_for(tbb::blocked_range<size_t>(0, data.size(), 1000),
                 [&](const tbb::blocked_range<size_t>& r) {
                     for (size_t i = r.begin(); i != r.end(); ++i) {
-                        //size_t nearest = nearestObj(data[i], _centroids);
-                        auto nearest = _optimizer.nearest(data[i], _centroids);
-                        if (nearest.index != _nearestCentroid[i]) {
+                        if (_boundsValid) {
+                            size_t a = _nearestCentroid[i];
+                            _upper[i] += drift[a];
+                            _lower[i] -= a == maxDriftIndex ? secondDrift : maxDrift;
+                            double bound = std::max(halfSeparation[a], _lower[i]);
+                            if (_upper[i] < bound) {
+                                continue;
+                            }
+                            _upper[i] = _optimizer.distance(data[i], _centroids[a]);
+                            if (_upper[i] < bound) {
+                                continue;
+                            }
+                        }
+                        // ties keep the first centroid, as in nearestBatch()
+                        size_t nearest = 0;
+                        double nearestDistance = std::numeric_limits<double>::max();
+                        double secondDistance = std::numeric_limits<double>::max();
+                        for (size_t c = 0; c < k; ++c) {
+                            double distance = _optimizer.distance(data[i], _centroids[c]);
+                            if (distance < nearestDistance) {
+                                secondDistance = nearestDistance;
+                                nearestDistance = distance;
+                                nearest = c;
+                            } else if (distance < secondDistance) {
+                                secondDistance = distance;
+                            }
+                        }
+                        if (nearest != _nearestCentroid[i]) {
                             _converged = false;
                         }
-                        _nearestCentroid[i] = nearest.index;
+                        _nearestCentroid[i] = nearest;
+                        _upper[i] = nearestDistance;
+                        _lower[i] = secondDistance;
                     }
                 }
         );
-        tbb::atomic_fence(); // make sure all writes are visible on all CPUs
 
-        // Serial
-        // Clear the nearest vectors in each cluster
-        for (Cluster<T> *c : _clusters) {
-            c->clearNearest();
-        }
-        // Accumlate into clusters
-        for (size_t i = 0; i < data.size(); i++) {
-            size_t nearest = _nearestCentroid[i];
-            _clusters[nearest]->addNearest(data[i]);
+        // Remember the centroids to measure how far they move. The copies
+        // are allocated once and reused by later iterations and clusterings.
+        for (size_t c = 0; c < k; ++c) {
+            if (c == _previousCentroids.size()) {
+                _previousCentroids.push_back(new T(*_centroids[c]));
+            } else if (_previousCentroids[c]->size() != _centroids[c]->size()) {
+                delete _previousCentroids[c];
+                _previousCentroids[c] = new T(*_centroids[c]);
+            } else {
+                copyData(_centroids[c], _previousCentroids[c]);
+            }
         }
+        _boundsValid = true;
+    }
 
+    /**
+     * Copies the values of from into to, which has the same size.
+     */
+    static void copyData(SVector<bool>* from, SVector<bool>* to) {
+        std::copy(from->getData(), from->getData() + from->getNumBlocks(), to->getData());
+    }
 
+    template <typename VECTOR>
+    static void copyData(VECTOR* from, VECTOR* to) {
+        std::copy(from->begin(), from->end(), to->begin());
     }
 
     /**
@@ -245,6 +456,11 @@ private:
     // The centroid index for each vector. Aligned with vectors member variable.
     vector<size_t> _nearestCentroid;
 
+    // The vectors grouped by cluster. The vectors of cluster c are in
+    // _members[_offsets[c]] to _members[_offsets[c + 1] - 1].
+    vector<T*> _members;
+    vector<size_t> _offsets;
+
     // Weights for prototype function (we don't have to use these)
     vector<int> _weights;
 
@@ -253,6 +469,22 @@ private:
     
     // has the clustering converged
     atomic<bool> _converged;    
+
+    // Vectors per batch for mini-batch k-means, 0 if not used
+    size_t _miniBatchSize = 0;
+
+    // Use Hamerly's algorithm in vectorsToNearestCentroid()
+    bool _accelerated = false;
+
+    // Hamerly's bounds for each vector. Aligned with vectors member variable.
+    // _upper is at least the distance to the nearest centroid and _lower is at
+    // most the distance to any other centroid.
+    vector<double> _upper;
+    vector<double> _lower;
+    bool _boundsValid = false;
+
+    // Copies of the centroids when the bounds were last updated.
+    vector<T*> _previousCentroids;
 };
 
 } // namespace lmw
@@ -0,0 +1,247 @@
+#ifndef KMEANS_PARALLEL_SEEDER_H
+#define KMEANS_PARALLEL_SEEDER_H
+
+#include "Distance.h"
+#include "Seeder.h"
+#include "StdIncludes.h"
+#include "tbb/parallel_for.h"
+
+namespace lmw {
+
+/**
+ * Seeds centroids with k-means|| (Bahmani et al., Scalable K-Means++, 2012).
+ *
+ * Instead of choosing one center per pass over the data as k-means++ does,
+ * each of a few rounds samples about oversampling * k candidates at once,
+ * with each vector chosen with probability proportional to its squared
+ * distance to the nearest candidate so far. The rounds run in parallel. The
+ * candidates are then weighted by how many vectors are nearest to them and
+ * reclustered into k centroids with weighted k-means++, which is cheap
+ * because there are only a few times k candidates.
+ *
+ * The data is processed in fixed size chunks with a random generator per
+ * chunk, so the seeds only depend on the random seed and not on the number of
+ * threads.
+ *
+ * For example,
+ *      typedef KMeansParallelSeeder<SVector<bool>, hammingDistance> SEEDER;
+ *      KMeans<SVector<bool>, SEEDER, OPTIMIZER> kmeans(1000);
+ */
+template <typename T, typename DistanceFunc>
+class KMeansParallelSeeder : public Seeder<T> {
+public:
+
+    KMeansParallelSeeder() : _eng((unsigned int) std::time(0)) { }
+
+    explicit KMeansParallelSeeder(unsigned int seed) : _eng(seed) { }
+
+    /**
+     * @param rounds The number of sampling rounds. The paper finds 5 enough.
+     */
+    void setRounds(int rounds) {
+        _rounds = rounds;
+    }
+
+    /**
+     * @param oversampling Candidates sampled per round as a multiple of the
+     *                     number of centroids.
+     */
+    void setOversampling(double oversampling) {
+        _oversampling = oversampling;
+    }
+
+    // Pre: The centroids vector is empty
+    void seed(vector<T*> &data, vector<T*> &centroids, int numCentres) {
+        centroids.clear();
+        if (data.empty() || numCentres <= 0) {
+            return;
+        }
+        vector<size_t> candidates;
+        vector<double> weights;
+        sampleCandidates(data, numCentres, candidates, weights);
+        vector<size_t> chosen;
+        recluster(data, candidates, weights, numCentres, chosen);
+        for (size_t index : chosen) {
+            centroids.push_back(new T(*data[index]));
+        }
+    }
+
+private:
+    static const size_t CHUNK_SIZE = 1024;
+    static const size_t CANDIDATE_TILE = 32;
+
+    // Draws from a referenced engine so the engine state advances.
+    typedef boost::uniform_01<RND_ENG&, double> Uniform;
+
+    /**
+     * Runs the sampling rounds. Candidates are indexes into data. The weight
+     * of a candidate is the number of vectors nearest to it.
+     */
+    void sampleCandidates(vector<T*> &data, int numCentres,
+            vector<size_t> &candidates, vector<double> &weights) {
+        const size_t n = data.size();
+        const size_t numChunks = (n + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        const double expected = _oversampling * numCentres;
+
+        // distance, squared distance and position in candidates of the
+        // nearest candidate of each vector
+        typedef typename DistanceBatch<T, DistanceFunc>::value_type value_type;
+        vector<value_type> closestDist(n);
+        vector<double> closestDistSq(n);
+        vector<size_t> closest(n, 0);
+        vector<double> chunkCost(numChunks);
+        vector<vector<size_t> > chunkSamples(numChunks);
+
+        candidates.push_back(_eng() % n);
+        size_t first = 0; // first candidate not yet applied to closestDistSq
+        for (int round = 0; round <= _rounds; ++round) {
+            // Update the nearest candidate with the new candidates and find the
+            // cost of each chunk. A chunk is compared with a tile of
+            // candidates at a time so the candidates stay in cache.
+            vector<T*> newCandidates;
+            for (size_t c = first; c < candidates.size(); ++c) {
+                newCandidates.push_back(data[candidates[c]]);
+            }
+            tbb::parallel_for(size_t(0), numChunks, [&](size_t chunk) {
+                DistanceBatch<T, DistanceFunc> batchDistance;
+                value_type distances[CANDIDATE_TILE];
+                size_t begin = chunk * CHUNK_SIZE;
+                size_t end = std::min(n, (chunk + 1) * CHUNK_SIZE);
+                for (size_t t = 0; t < newCandidates.size(); t += CANDIDATE_TILE) {
+                    size_t count = std::min(CANDIDATE_TILE, newCandidates.size() - t);
+                    for (size_t i = begin; i < end; ++i) {
+                        batchDistance(_df, data[i], &newCandidates[t], count, distances);
+                        for (size_t j = 0; j < count; ++j) {
+                            size_t c = first + t + j;
+                            if (c == 0 || distances[j] < closestDist[i]) {
+                                closestDist[i] = distances[j];
+                                closest[i] = c;
+                            }
+                        }
+                    }
+                }
+                double cost = 0;
+                for (size_t i = begin; i < end; ++i) {
+                    if (closest[i] >= first) {
+                        closestDistSq[i] = _df.squared(data[i], data[candidates[closest[i]]]);
+                    }
+                    cost += closestDistSq[i];
+                }
+                chunkCost[chunk] = cost;
+            });
+            first = candidates.size();
+            double cost = 0;
+            for (double c : chunkCost) {
+                cost += c;
+            }
+            if (round == _rounds || cost == 0) {
+                break;
+            }
+
+            // Sample each vector independently in proportion to its cost.
+            unsigned int roundSeed = _eng();
+            tbb::parallel_for(size_t(0), numChunks, [&](size_t chunk) {
+                RND_ENG eng(roundSeed + chunk);
+                Uniform uniform(eng);
+                vector<size_t>& samples = chunkSamples[chunk];
+                samples.clear();
+                size_t end = std::min(n, (chunk + 1) * CHUNK_SIZE);
+                for (size_t i = chunk * CHUNK_SIZE; i < end; ++i) {
+                    if (uniform() * cost < expected * closestDistSq[i]) {
+                        samples.push_back(i);
+                    }
+                }
+            });
+            for (auto& samples : chunkSamples) {
+                candidates.insert(candidates.end(), samples.begin(), samples.end());
+            }
+        }
+
+        weights.assign(candidates.size(), 0);
+        for (size_t i = 0; i < n; ++i) {
+            weights[closest[i]] += 1;
+        }
+    }
+
+    /**
+     * Chooses numCentres of the weighted candidates with k-means++. If there
+     * are fewer candidates than centres, random vectors are added.
+     */
+    void recluster(vector<T*> &data, vector<size_t> &candidates,
+            vector<double> &weights, int numCentres, vector<size_t> &chosen) {
+        const size_t m = candidates.size();
+        if (m <= size_t(numCentres)) {
+            chosen = candidates;
+            for (size_t i = 0; chosen.size() < size_t(numCentres) && i < data.size(); ++i) {
+                size_t index = _eng() % data.size();
+                if (std::find(chosen.begin(), chosen.end(), index) == chosen.end()) {
+                    chosen.push_back(index);
+                }
+            }
+            return;
+        }
+
+        Uniform uniform(_eng);
+        vector<double> closestDistSq(m, std::numeric_limits<double>::max());
+        vector<bool> taken(m, false);
+        size_t next = chooseWeighted(weights, taken, uniform);
+        for (int centre = 0; centre < numCentres; ++centre) {
+            taken[next] = true;
+            chosen.push_back(candidates[next]);
+            if (centre + 1 == numCentres) {
+                break;
+            }
+            T* centroid = data[candidates[next]];
+            tbb::parallel_for(size_t(0), m, [&](size_t c) {
+                double distance = _df.squared(data[candidates[c]], centroid);
+                closestDistSq[c] = std::min(closestDistSq[c], distance);
+            });
+            vector<double> cost(m);
+            for (size_t c = 0; c < m; ++c) {
+                cost[c] = weights[c] * closestDistSq[c];
+            }
+            next = chooseWeighted(cost, taken, uniform);
+        }
+    }
+
+    /**
+     * Chooses an index that is not taken with probability proportional to
+     * cost. When all costs are zero the first index not taken is chosen.
+     */
+    static size_t chooseWeighted(vector<double> &cost, vector<bool> &taken,
+            Uniform &uniform) {
+        double total = 0;
+        for (size_t i = 0; i < cost.size(); ++i) {
+            if (!taken[i]) {
+                total += cost[i];
+            }
+        }
+        double value = uniform() * total;
+        size_t last = 0;
+        for (size_t i = 0; i < cost.size(); ++i) {
+            if (taken[i]) {
+                continue;
+            }
+            last = i;
+            if (total > 0 && value < cost[i]) {
+                return i;
+            }
+            if (total == 0) {
+                return i;
+            }
+            value -= cost[i];
+        }
+        // rounding errors
+        return last;
+    }
+
+    DistanceFunc _df;
+    RND_ENG _eng;
+
+    int _rounds = 5;
+    double _oversampling = 2;
+};
+
+} // namespace lmw
+
+#endif
@@ -3,9 +3,14 @@
 
 #include "StdIncludes.h"
 
+#include "BeamSearch.h"
+#include "FlatTree.h"
 #include "Node.h"
 #include "KMeans.h"
 #include "NodeVisitor.h"
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
+#include "tbb/task.h"
 
 namespace lmw {
 
@@ -34,9 +39,12 @@ public:
         _root = new Node<T>(); // initial root is a leaf
         _clusterer.setMaxIters(clustererMaxiters);
         _clusterer.setEnforceNumClusters(true);
+        _clustererMaxIters = clustererMaxiters;
         _added = 0;
         _delayedUpdates = false;
         _updateDelay = 1000;
+        _batchSize = 1000;
+        _inBatch = false;
     }
     
     ~KTree() {
@@ -51,6 +59,13 @@ public:
         _delayedUpdates = delayedUpdates;
     }
 
+    /**
+     * @param batchSize The number of vectors add(data) routes at once.
+     */
+    void setBatchSize(size_t batchSize) {
+        _batchSize = batchSize;
+    }
+
     int getClusterCount() {
         return clusterCount(_root);
     }
@@ -64,7 +79,7 @@ public:
     }
 
     uint64_t getObjCount() {
-        return objCount(_root);
+        return _root->getObjCount();
     }
 
     int getLevelCount() {
@@ -120,14 +135,120 @@ public:
     }
 
     void add(T *obj) {
-        SplitResult<T> result = pushDown(_root, obj);
-        if (result.isSplit) {
-            _root = new Node<T>();
-            _root->add(result._key1, result._child1);
-            _root->add(result._key2, result._child2);
+        add(obj, NULL);
+    }
+
+    /**
+     * Adds all of data, in order, a batch at a time.
+     *
+     * The path from the root to the nearest leaf is found for every vector in
+     * a batch in parallel, against the tree as it is at the start of the
+     * batch. The vectors are then inserted one at a time along their paths,
+     * updating prototypes and splitting nodes exactly as add(obj) does, so the
+     * tree keeps the K-tree invariants. A vector whose path went through a
+     * node that has split since is pushed down from the root again. As with
+     * delayed updates, a vector may miss the nearest key when prototypes move
+     * during the batch.
+     */
+    void add(vector<T*> &data) {
+        for (size_t first = 0; first < data.size(); first += _batchSize) {
+            size_t last = std::min(data.size(), first + _batchSize);
+            addBatch(data, first, last);
+        }
+    }
+
+    /**
+     * Replaces the contents of the tree with a K-tree built bottom-up from
+     * data, without the splits and prototype updates of adding one vector at
+     * a time.
+     *
+     * The data is divided into leaves of at most order vectors by recursive
+     * 2-means, the way an overflowing node is split by add(). The prototypes
+     * of the leaves are then divided the same way into the nodes of the level
+     * above, and so on until at most order nodes remain under the root. So
+     * all leaves are at the same depth and every key is the prototype of its
+     * child. The partitions are found in parallel, and add() can be used
+     * afterwards.
+     */
+    void bulkLoad(vector<T*> &data) {
+        delete _root;
+        _root = new Node<T>();
+        if (data.size() <= size_t(_m)) {
+            _root->addAll(data);
+        } else {
+            vector<vector<T*> > groups;
+            partition(data, groups);
+            vector<Node<T>*> nodes;
+            for (vector<T*> &group : groups) {
+                Node<T>* leaf = new Node<T>();
+                leaf->addAll(group);
+                leaf->refreshObjCount();
+                nodes.push_back(leaf);
+            }
+
+            // build each level on the prototypes of the one below
+            while (nodes.size() > size_t(_m)) {
+                vector<T*> keys;
+                prototypes(nodes, keys);
+                unordered_map<T*, Node<T>*> childOf;
+                for (size_t i = 0; i < keys.size(); i++) {
+                    childOf[keys[i]] = nodes[i];
+                }
+                groups.clear();
+                partition(keys, groups);
+                nodes.clear();
+                for (vector<T*> &group : groups) {
+                    Node<T>* parent = new Node<T>();
+                    parent->setOwnsKeys(true);
+                    for (T* key : group) {
+                        parent->add(key, childOf[key]);
+                    }
+                    parent->refreshObjCount();
+                    nodes.push_back(parent);
+                }
+            }
+
+            vector<T*> keys;
+            prototypes(nodes, keys);
+            for (size_t i = 0; i < nodes.size(); i++) {
+                _root->add(keys[i], nodes[i]);
+            }
             _root->setOwnsKeys(true);
         }
-        ++_added;
+        _root->refreshObjCount();
+        _added = data.size();
+    }
+
+    /**
+     * A FlatTree snapshot of the tree for fast queries. The leaf keys are
+     * copies of the data vectors, and their sources are the vectors. The
+     * counts and errors of internal keys are those of their subtrees. The
+     * caller deletes the snapshot.
+     */
+    FlatTree<T>* freeze() {
+        // fill the cached errors recorded by the snapshot
+        sumSquaredError(NULL, _root);
+        return new FlatTree<T>(_root);
+    }
+
+    /**
+     * Searches the tree with BeamSearch. The neighbours are the objects added
+     * to the tree.
+     */
+    vector<Neighbour<T> > search(T* query, int k, int beamWidth) {
+        BeamSearch<T, typename OPTIMIZER::distance_type> beamSearch(k, beamWidth);
+        vector<Neighbour<T> > neighbours;
+        beamSearch.search(_root, query, neighbours);
+        return neighbours;
+    }
+
+    /**
+     * Searches for all queries in parallel.
+     */
+    void search(vector<T*>& queries, int k, int beamWidth,
+            vector<vector<Neighbour<T> > >& neighbours) {
+        BeamSearch<T, typename OPTIMIZER::distance_type> beamSearch(k, beamWidth);
+        beamSearch.search(_root, queries, neighbours);
     }
 
     double getRMSE() {
@@ -146,6 +267,171 @@ public:
 
 private:
 
+    /**
+     * Splits a node in two with 2-means, and then each half in a separate
+     * task, until every leaf below it holds at most order keys.
+     */
+    class PartitionTask : public tbb::task {
+    public:
+
+        PartitionTask(Node<T>* current, int order, int maxiters) :
+            _current(current), _m(order), _maxIters(maxiters) {
+        }
+
+        tbb::task* execute() {
+            if (_current->size() <= _m) {
+                return NULL;
+            }
+            split();
+            vector<PartitionTask*> childTasks;
+            for (Node<T>* n : _current->getChildren()) {
+                childTasks.push_back(new(allocate_child()) PartitionTask(n, _m, _maxIters));
+            }
+            set_ref_count(childTasks.size() + 1);
+            for (size_t i = 1; i < childTasks.size(); i++) {
+                tbb::task::spawn(*childTasks[i]);
+            }
+            tbb::task::spawn_and_wait_for_all(*childTasks[0]);
+            return NULL;
+        }
+
+    private:
+
+        void split() {
+            CLUSTERER clusterer(2);
+            clusterer.setMaxIters(_maxIters);
+            clusterer.setEnforceNumClusters(true);
+            vector<Cluster<T>*>& clusters = clusterer.cluster(_current->getKeys());
+            _current->clearKeysAndChildren();
+            for (Cluster<T>* c : clusters) {
+                Node<T>* child = new Node<T>();
+                child->addAll(c->getNearestList());
+                _current->add(c->getCentroid(), child);
+            }
+            _current->setOwnsKeys(true);
+        }
+
+        Node<T>* _current;
+
+        // The order of the tree
+        int _m;
+
+        // The maximum number of k-means iterations
+        int _maxIters;
+    };
+
+    /**
+     * Divides objs into groups of at most _m objects for bulkLoad().
+     */
+    void partition(vector<T*> &objs, vector<vector<T*> > &groups) {
+        Node<T> top;
+        top.addAll(objs);
+        PartitionTask *t = new(tbb::task::allocate_root()) PartitionTask(&top, _m,
+                _clustererMaxIters);
+        tbb::task::spawn_root_and_wait(*t);
+        collectLeafKeys(&top, groups);
+    }
+
+    void collectLeafKeys(Node<T>* n, vector<vector<T*> > &groups) {
+        if (n->isLeaf()) {
+            groups.push_back(n->getKeys());
+        } else {
+            for (Node<T>* child : n->getChildren()) {
+                collectLeafKeys(child, groups);
+            }
+        }
+    }
+
+    /**
+     * Makes a new prototype for each node from its keys, weighted by the
+     * object counts of its children.
+     */
+    void prototypes(vector<Node<T>*> &nodes, vector<T*> &keys) {
+        keys.resize(nodes.size());
+        tbb::parallel_for(size_t(0), nodes.size(), [&](size_t i) {
+            Node<T>* n = nodes[i];
+            vector<int> weights;
+            if (!n->isLeaf()) {
+                for (Node<T>* child : n->getChildren()) {
+                    weights.push_back(child->getObjCount());
+                }
+            }
+            keys[i] = new T(*n->getKey(0));
+            _optimizer.updatePrototype(keys[i], n->getKeys(), weights);
+        });
+    }
+
+    void addBatch(vector<T*> &data, size_t first, size_t last) {
+        // route every vector in parallel
+        Node<T>* root = _root;
+        const size_t depth = getLevelCount() - 1;
+        vector<size_t> routes((last - first) * depth);
+        tbb::parallel_for(tbb::blocked_range<size_t>(first, last),
+                [&](const tbb::blocked_range<size_t>& r) {
+                    for (size_t i = r.begin(); i < r.end(); ++i) {
+                        route(root, data[i], routes.data() + (i - first) * depth);
+                    }
+                }
+        );
+
+        // insert along the routes, watching for splits
+        _inBatch = true;
+        for (size_t i = first; i < last; ++i) {
+            const size_t* path = routes.data() + (i - first) * depth;
+            if (_root != root || crossesSplit(path, depth)) {
+                path = NULL;
+            }
+            add(data[i], path);
+        }
+        _inBatch = false;
+        _splitNodes.clear();
+    }
+
+    /**
+     * Adds obj down the given path of child indexes, or to the nearest leaf if
+     * path is NULL.
+     */
+    void add(T *obj, const size_t *path) {
+        SplitResult<T> result = pushDown(_root, obj, path);
+        if (result.isSplit) {
+            _root = new Node<T>();
+            _root->add(result._key1, result._child1);
+            _root->add(result._key2, result._child2);
+            _root->setOwnsKeys(true);
+            _root->refreshObjCount();
+        }
+        ++_added;
+    }
+
+    /**
+     * Writes the index of the nearest child at each level below n to path.
+     */
+    void route(Node<T> *n, T *vec, size_t *path) {
+        while (!n->isLeaf()) {
+            size_t index = _optimizer.nearest(vec, n->getKeys()).index;
+            *path++ = index;
+            n = n->getChild(index);
+        }
+    }
+
+    /**
+     * Is any node along path from the root in _splitNodes? A split reorders
+     * the children of a node, so the indexes below it are no longer valid.
+     */
+    bool crossesSplit(const size_t *path, size_t depth) {
+        if (_splitNodes.empty()) {
+            return false;
+        }
+        Node<T>* n = _root;
+        for (size_t level = 0; level < depth; ++level) {
+            if (_splitNodes.count(n)) {
+                return true;
+            }
+            n = n->getChild(path[level]);
+        }
+        return _splitNodes.count(n) > 0;
+    }
+
     double RMSE() {
         double RMSE = sumSquaredError(NULL, _root);
         uint64_t size = getObjCount();
@@ -177,10 +463,16 @@ private:
         }
     }
 
+    // The result is cached in child until the tree changes.
     double sumSquaredError(T* parentKey, Node<T> *child) {
+        if (child->hasSumSquaredError()) {
+            return child->getSumSquaredError();
+        }
         double distance = 0.0;
         if (child->isLeaf()) {
-            distance += _optimizer.sumSquaredError(parentKey, child->getKeys());
+            if (parentKey) { // NULL if root node is leaf
+                distance += _optimizer.sumSquaredError(parentKey, child->getKeys());
+            }
         } else {
             vector<T*> &keys = child->getKeys();
             vector<Node<T>*> &children = child->getChildren();
@@ -188,23 +480,10 @@ private:
                 distance += sumSquaredError(keys[i], children[i]);
             }
         }
+        child->setSumSquaredError(distance);
         return distance;
     }
 
-    uint64_t objCount(Node<T>* current) {
-        if (current->isLeaf()) {
-            return current->size();
-        } else {
-            uint64_t localCount = 0;
-            vector<Node<T>*>& children = current->getChildren();
-            for (Node<T> *child : children) {
-                localCount += objCount(child);
-
-            }
-            return localCount;
-        }
-    }
-
     int clusterCount(Node<T>* current) {
         if (current->isLeaf()) {
             if (current->isEmpty()) {
@@ -264,6 +543,9 @@ private:
         }
     }
 
+    /**
+     * Only empty subtrees are removed, so the object counts do not change.
+     */
     int prune(Node<T>* n) {
         if (n->isLeaf()) {
             return 0; // non-empty leaf node
@@ -283,10 +565,16 @@ private:
         }
     }
 
+    /**
+     * Updates the keys of the children of the nodes at depth below n. The
+     * cached errors of those children and of the nodes above are invalidated.
+     */
     void rebuildInternal(Node<T> *n, int depth) {
 
         if (n->isLeaf()) return;
 
+        n->invalidateSumSquaredError();
+
         vector<Node<T>*> &children = n->getChildren();
 
         if (depth == 1) {
@@ -295,6 +583,7 @@ private:
                 Node<T>* child = children[i];
                 T* key = keys[i];
                 updatePrototype(child, key);
+                child->invalidateSumSquaredError();
             }
         } else {
             for (int i = 0; i < children.size(); ++i) {
@@ -303,8 +592,14 @@ private:
         }
     }
 
+    /**
+     * Adds vec to the nearest leaf below n, counting it in the nodes along
+     * the path.
+     */
     void pushDownNoUpdate(Node<T> *n, T *vec) {
         //std::cout << "\n\tPushing down (no update) ...";
+        n->setObjCount(n->getObjCount() + 1);
+        n->invalidateSumSquaredError();
         if (n->isLeaf()) {
             n->add(vec); // Finished
         } else { // It is an internal node.
@@ -314,8 +609,23 @@ private:
         }
     }
 
-    SplitResult<T> pushDown(Node<T> *n, T *vec) {
+    /**
+     * Inserts vec below n. The object counts of the nodes along the insertion
+     * path are refreshed, and their cached errors are invalidated because
+     * their keys and data change.
+     */
+    SplitResult<T> pushDown(Node<T> *n, T *vec, const size_t *path = NULL) {
         //std::cout << "\n\tPushing down ...";
+        SplitResult<T> result = pushDownUpdate(n, vec, path);
+        n->refreshObjCount();
+        n->invalidateSumSquaredError();
+        if (result.isSplit) {
+            result._child2->refreshObjCount();
+        }
+        return result;
+    }
+
+    SplitResult<T> pushDownUpdate(Node<T> *n, T *vec, const size_t *path) {
         SplitResult<T> result;
         if (n->isLeaf()) {
             if (n->size() >= _m) {
@@ -325,10 +635,14 @@ private:
                 n->add(vec); // Finished
             }
         } else { // It is an internal node.
-            // recurse via nearest neighbour cluster
-            vector<T*>& keys = n->getKeys();
-            auto nearest = _optimizer.nearest(vec, keys);
-            result = pushDown(n->getChild(nearest.index), vec);
+            // recurse via the routed or nearest neighbour cluster
+            size_t index;
+            if (path) {
+                index = *path++;
+            } else {
+                index = _optimizer.nearest(vec, n->getKeys()).index;
+            }
+            result = pushDown(n->getChild(index), vec, path);
             if (result.isSplit) {
                 updatePrototype(result._child1, result._key1);
                 updatePrototype(result._child2, result._key2);
@@ -344,7 +658,7 @@ private:
                 }
             } else {
                 if (!_delayedUpdates || (_delayedUpdates && _added % _updateDelay == 0)) {
-                    updatePrototype(n->getChild(nearest.index), n->getKey(nearest.index));
+                    updatePrototype(n->getChild(index), n->getKey(index));
                 }
             }
         }
@@ -372,8 +686,17 @@ private:
         tempChildren = parent->getChildren();
         tempChildren.push_back(child);
 
+        // Remember which child each key belongs to, clustering reorders keys
+        unordered_map<T*, Node<T>*> childOf;
+        for (size_t i = 0; i < tempKeys.size(); i++) {
+            childOf[tempKeys[i]] = tempChildren[i];
+        }
+
         // DetachRemove children from child node
         parent->clearKeysAndChildren();
+        if (_inBatch) {
+            _splitNodes.insert(parent);
+        }
 
         // At this point we have 2 clear nodes: "parent" node (node 1) and "node2"
 
@@ -385,10 +708,10 @@ private:
 
         // Get nearest centroids after clustering
         for (auto key : clusters[0]->getNearestList()) {
-            parent->add(key);
+            parent->add(key, childOf[key]);
         }
         for (auto key : clusters[1]->getNearestList()) {
-            node2->add(key);
+            node2->add(key, childOf[key]);
         }        
 
         // Now make our split result
@@ -420,6 +743,9 @@ private:
 
         // DetachRemove children from child node
         child->clearKeysAndChildren();
+        if (_inBatch) {
+            _splitNodes.insert(child);
+        }
 
         // At this point we have 2 clear nodes: "child" node (node 1) and "node2"
 
@@ -460,7 +786,7 @@ private:
             vector<Node<T>*>& children = child->getChildren();
 
             for (size_t i = 0; i < children.size(); i++) {
-                weights.push_back(objCount(children[i]));
+                weights.push_back(children[i]->getObjCount());
             }
         }
 
@@ -468,7 +794,8 @@ private:
     }
 
     void removeData(Node<T> *n, vector<T*> &data) {
-
+        n->setObjCount(0);
+        n->invalidateSumSquaredError();
         if (n->isLeaf()) {
             n->removeData(data);
         } else {
@@ -483,6 +810,9 @@ private:
     // The order of this tree
     int _m;
 
+    // The maximum number of iterations of k-means when splitting
+    int _clustererMaxIters;
+
     // The root of the tree.
     Node<T> *_root;
 
@@ -509,6 +839,13 @@ private:
 
     // Update along insertion path every _updateDelay insertions.
     int _updateDelay;
+
+    // How many vectors add(data) routes in parallel at once.
+    size_t _batchSize;
+
+    // Nodes split since the current batch was routed.
+    bool _inBatch;
+    unordered_set<Node<T>*> _splitNodes;
 };
 
 } // namespace lmw
@@ -0,0 +1,188 @@
+#ifndef MAPPEDSVECTORSTREAM_H
+#define	MAPPEDSVECTORSTREAM_H
+
+#include "StdIncludes.h"
+#include "SVector.h"
+#include "tbb/mutex.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace lmw {
+
+/**
+ * A MappedSVectorStream is a VectorStream of bit vectors that memory maps the
+ * ID and signature files instead of reading them. See SVectorStream.h for the
+ * VectorStream concept.
+ *
+ * The vectors returned by read() are views directly into the mapped signature
+ * file, so signatures are never copied. The views are recycled when they are
+ * returned with free(), so after the first few reads the stream allocates
+ * nothing. IDs are found by scanning the mapped ID file for newlines.
+ *
+ * The mapping is read only. The vectors must not be modified and are invalid
+ * once they have been passed to free() or the stream is destroyed.
+ *
+ * For example,
+ *      MappedSVectorStream vs(idFile, signatureFile, 4096);
+ *      size_t read = streamingEMTree.insert(vs);
+ */
+class MappedSVectorStream {
+public:
+    /**
+     * @param idFile An ASCII file with one object ID per line.
+     * @param signatureFile A file of binary signatures containing as many
+     *                      signatures as there are lines in idFile.
+     * @param signatureLength The length of a signature in bits.
+     * @param maxToRead The maximum number of vectors to read. A value of -1
+     *                  indicates to read all.
+     */
+    MappedSVectorStream(const string& idFile, const string& signatureFile,
+            const size_t signatureLength, const size_t maxToRead = -1) :
+            _signatureLength(signatureLength),
+            _signatureBytes(signatureLength / 8),
+            _maxToRead(maxToRead),
+            _count(0) {
+        if (signatureLength % 64 != 0) {
+            throw runtime_error("length is not divisible by 64");
+        }
+        _ids = static_cast<const char*>(map(idFile, &_idsSize));
+        try {
+            _signatures = static_cast<const char*>(map(signatureFile, &_signaturesSize));
+        } catch (...) {
+            // the destructor does not run for a partially constructed stream
+            unmap(_ids, _idsSize);
+            throw;
+        }
+        _idCursor = _ids;
+        _numSignatures = _signaturesSize / _signatureBytes;
+    }
+
+    ~MappedSVectorStream() {
+        Utils::purge(_views);
+        unmap(_ids, _idsSize);
+        unmap(_signatures, _signaturesSize);
+    }
+
+    size_t read(size_t n, vector<SVector<bool>*>* data) {
+        const char* idsEnd = _ids + _idsSize;
+        size_t available = std::min(_maxToRead, _numSignatures) - _count;
+        size_t start = data->size();
+        takeViews(std::min(n, available), data);
+        size_t read = 0;
+        for (size_t i = start; i < data->size() && _idCursor < idsEnd; ++i) {
+            const char* end = static_cast<const char*>(
+                    memchr(_idCursor, '\n', idsEnd - _idCursor));
+            if (!end) {
+                end = idsEnd;
+            }
+            const char* signature = _signatures + _count * _signatureBytes;
+            SVector<bool>* vector = (*data)[i];
+            vector->setData(reinterpret_cast<block_type*>(const_cast<char*>(signature)));
+            vector->setID(_idCursor, end - _idCursor);
+            _idCursor = end + 1;
+            ++_count;
+            ++read;
+        }
+        if (start + read < data->size()) {
+            // the ID file ended first
+            vector<SVector<bool>*> unused(data->begin() + start + read, data->end());
+            data->resize(start + read);
+            free(&unused);
+        }
+        return read;
+    }
+
+    size_t skip(size_t n) {
+        const char* idsEnd = _ids + _idsSize;
+        size_t available = std::min(_maxToRead, _numSignatures) - _count;
+        size_t skipped = 0;
+        while (skipped < std::min(n, available) && _idCursor < idsEnd) {
+            const char* end = static_cast<const char*>(
+                    memchr(_idCursor, '\n', idsEnd - _idCursor));
+            _idCursor = end ? end + 1 : idsEnd;
+            ++_count;
+            ++skipped;
+        }
+        return skipped;
+    }
+
+    /**
+     * Returns the views in data to the stream for reuse. It is thread safe.
+     */
+    void free(vector<SVector<bool>*>* data) {
+        tbb::mutex::scoped_lock lock(_mutex);
+        _views.insert(_views.end(), data->begin(), data->end());
+    }
+
+private:
+    MappedSVectorStream(const MappedSVectorStream&) = delete;
+    MappedSVectorStream& operator=(const MappedSVectorStream&) = delete;
+
+    /**
+     * Appends n views to data, reusing freed views before allocating new ones.
+     */
+    void takeViews(size_t n, vector<SVector<bool>*>* data) {
+        {
+            tbb::mutex::scoped_lock lock(_mutex);
+            size_t reused = std::min(n, _views.size());
+            data->insert(data->end(), _views.end() - reused, _views.end());
+            _views.resize(_views.size() - reused);
+            n -= reused;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            data->push_back(new SVector<bool>(static_cast<block_type*>(NULL), _signatureLength));
+        }
+    }
+
+    static void* map(const string& file, size_t* size) {
+        int fd = open(file.c_str(), O_RDONLY);
+        if (fd == -1) {
+            throw runtime_error("failed to open " + file);
+        }
+        struct stat info;
+        if (fstat(fd, &info) == -1) {
+            close(fd);
+            throw runtime_error("failed to stat " + file);
+        }
+        *size = info.st_size;
+        if (*size == 0) {
+            close(fd);
+            return NULL;
+        }
+        void* data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            throw runtime_error("failed to map " + file);
+        }
+        madvise(data, *size, MADV_SEQUENTIAL);
+        return data;
+    }
+
+    static void unmap(const void* data, size_t size) {
+        if (data) {
+            munmap(const_cast<void*>(data), size);
+        }
+    }
+
+    size_t _signatureLength; // in bits
+    size_t _signatureBytes;
+    size_t _maxToRead;
+    size_t _count; // Number of vectors read so far
+
+    const char* _ids;
+    size_t _idsSize;
+    const char* _idCursor; // start of the next ID
+    const char* _signatures;
+    size_t _signaturesSize;
+    size_t _numSignatures;
+
+    tbb::mutex _mutex; // protects _views
+    vector<SVector<bool>*> _views; // views that can be reused
+};
+
+} // namespace lmw
+
+#endif	/* MAPPEDSVECTORSTREAM_H */
@@ -0,0 +1,104 @@
+#ifndef MINIBATCHACCUMULATOR_H
+#define	MINIBATCHACCUMULATOR_H
+
+#include "StdIncludes.h"
+#include "SVector.h"
+#include "BitSlicedCounter.h"
+
+namespace lmw {
+
+/**
+ * A MiniBatchAccumulator sums all the vectors ever assigned to one centroid
+ * by mini-batch k-means, so the centroid can be updated incrementally after
+ * each batch without revisiting earlier batches.
+ *
+ * The default keeps a running sum and sets the centroid to the mean, which
+ * suits vectors of numbers such as SVector<float>.
+ *
+ * For example,
+ *      MiniBatchAccumulator<T> accumulator(centroid);
+ *      accumulator.add(&batch[0], batch.size());
+ *      bool changed = accumulator.update(centroid);
+ */
+template <typename T>
+class MiniBatchAccumulator {
+public:
+    explicit MiniBatchAccumulator(T* centroid) : _sums(centroid->size(), 0), _count(0) {
+    }
+
+    void add(T** objects, size_t n) {
+        for (size_t j = 0; j < n; ++j) {
+            for (size_t i = 0; i < _sums.size(); ++i) {
+                _sums[i] += (*objects[j])[i];
+            }
+        }
+        _count += n;
+    }
+
+    /**
+     * Sets centroid to the mean of all added vectors. It is unchanged if none
+     * have been added. Returns whether the centroid changed.
+     */
+    bool update(T* centroid) {
+        if (_count == 0) {
+            return false;
+        }
+        bool changed = false;
+        for (size_t i = 0; i < _sums.size(); ++i) {
+            auto& value = (*centroid)[i];
+            auto previous = value;
+            value = _sums[i] / _count;
+            changed = changed || value != previous;
+        }
+        return changed;
+    }
+
+private:
+    vector<double> _sums;
+    uint64_t _count;
+};
+
+/**
+ * Bit vectors count the set bits of each dimension with a BitSlicedCounter,
+ * and the centroid is the majority vote as in meanBitPrototypeBitSliced.
+ */
+template <>
+class MiniBatchAccumulator<SVector<bool> > {
+public:
+    explicit MiniBatchAccumulator(SVector<bool>* centroid) :
+            _counter(centroid->getNumBlocks()), _count(0),
+            _majority(centroid->getNumBlocks()) {
+    }
+
+    void add(SVector<bool>** objects, size_t n) {
+        _rows.resize(n);
+        for (size_t j = 0; j < n; ++j) {
+            _rows[j] = objects[j]->getData();
+        }
+        _counter.add(_rows.data(), n);
+        _count += n;
+    }
+
+    bool update(SVector<bool>* centroid) {
+        if (_count == 0) {
+            return false;
+        }
+        _counter.greaterThan(_count / 2, _majority.data());
+        block_type* data = centroid->getData();
+        if (std::equal(_majority.begin(), _majority.end(), data)) {
+            return false;
+        }
+        std::copy(_majority.begin(), _majority.end(), data);
+        return true;
+    }
+
+private:
+    BitSlicedCounter _counter;
+    uint64_t _count;
+    vector<const block_type*> _rows;
+    vector<block_type> _majority; // the majority vote before it is copied
+};
+
+} // namespace lmw
+
+#endif	/* MINIBATCHACCUMULATOR_H */
@@ -8,7 +8,8 @@ namespace lmw {
 template <typename T>
 class Node {
 public:
-    Node() : _isLeaf(true), _ownsKeys(false) { }
+    Node() : _isLeaf(true), _ownsKeys(false), _objCount(0),
+            _sumSquaredError(0), _hasSumSquaredError(false) { }
     
     ~Node() {
         for (size_t i = 0; i < size(); i++) {
@@ -36,6 +37,69 @@ public:
         _ownsKeys = ownsKeys;
     }
 
+    /**
+     * The number of objects in the subtree below this node. It is maintained
+     * by the tree algorithms as objects are inserted, moved and removed.
+     */
+    uint64_t getObjCount() {
+        return _objCount;
+    }
+
+    void setObjCount(uint64_t objCount) {
+        _objCount = objCount;
+    }
+
+    /**
+     * Recounts the objects of a leaf from its keys, or of an internal node
+     * from the counts of its children.
+     */
+    void refreshObjCount() {
+        if (_isLeaf) {
+            _objCount = _keys.size();
+        } else {
+            _objCount = 0;
+            for (Node* child : _children) {
+                _objCount += child->getObjCount();
+            }
+        }
+    }
+
+    /**
+     * Refreshes the object counts and invalidates the sum of squared errors
+     * of the whole subtree. Use this after objects have been moved.
+     */
+    void refreshAggregates() {
+        if (!_isLeaf) {
+            for (Node* child : _children) {
+                child->refreshAggregates();
+            }
+        }
+        refreshObjCount();
+        invalidateSumSquaredError();
+    }
+
+    /**
+     * The sum of squared errors of the objects below this node with respect
+     * to the cluster representatives they belong to. It is calculated lazily
+     * by the tree and cached until it is invalidated.
+     */
+    bool hasSumSquaredError() {
+        return _hasSumSquaredError;
+    }
+
+    double getSumSquaredError() {
+        return _sumSquaredError;
+    }
+
+    void setSumSquaredError(double sumSquaredError) {
+        _sumSquaredError = sumSquaredError;
+        _hasSumSquaredError = true;
+    }
+
+    void invalidateSumSquaredError() {
+        _hasSumSquaredError = false;
+    }
+
     T* getKey(int i) {
         return _keys[i];
     }
@@ -154,6 +218,13 @@ private:
     
     // Will the keys be deleted?
     bool _ownsKeys;
+
+    // Number of objects in this subtree.
+    uint64_t _objCount;
+
+    // Cached sum of squared errors of this subtree, if _hasSumSquaredError.
+    double _sumSquaredError;
+    bool _hasSumSquaredError;
 };
 
 } // namespace lmw
@@ -16,19 +16,54 @@
 #define	OPTIMIZER_H
 
 #include "StdIncludes.h"
+#include "Distance.h"
 
 namespace lmw {
 
+/**
+ * A COMPARATOR decides if currentDistance is better than nearestDistance. The
+ * best function returns the index of the first best value out of n values. It
+ * is written as a reduction followed by a search so that the compiler can
+ * vectorize it.
+ */
 struct Minimize {
     bool operator()(double currentDistance, double nearestDistance) {
         return currentDistance < nearestDistance;
     }
+
+    template <typename V>
+    size_t best(const V* values, size_t n) {
+        V nearest = values[0];
+        for (size_t i = 1; i < n; ++i) {
+            nearest = values[i] < nearest ? values[i] : nearest;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            if (values[i] == nearest) {
+                return i;
+            }
+        }
+        return 0;
+    }
 };
 
 struct Maximize {
     bool operator()(double currentDistance, double nearestDistance) {
         return currentDistance > nearestDistance;
     }
+
+    template <typename V>
+    size_t best(const V* values, size_t n) {
+        V nearest = values[0];
+        for (size_t i = 1; i < n; ++i) {
+            nearest = values[i] > nearest ? values[i] : nearest;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            if (values[i] == nearest) {
+                return i;
+            }
+        }
+        return 0;
+    }
 };
 
 template <typename KEY>
@@ -41,6 +76,7 @@ struct Nearest {
 template <typename T, typename DISTANCE, typename COMPARATOR, typename PROTOTYPE>
 class Optimizer {
 public:
+    typedef DISTANCE distance_type;
         
     void updatePrototype(T* prototype, vector<T*>& neighbours, vector<int>& weights) {
         _prototype(prototype, neighbours, weights);
@@ -63,6 +99,72 @@ public:
         return nearestAccessor(object, others, accessor);
     }
     
+    /**
+     * Finds the nearest key for every query, so that out[i] is the same as
+     * nearest(queries[i], keys).
+     * 
+     * Queries are processed in blocks of QUERY_TILE and keys in tiles of
+     * KEY_TILE. Every query in a block is compared with a tile of keys before
+     * moving to the next tile, so the keys stay in cache while they are
+     * reused. Distances of a tile are calculated with DistanceBatch, which uses
+     * integers and vectorized kernels for bit vectors.
+     */
+    void nearestBatch(vector<T*>& queries, vector<T*>& keys, vector<Nearest<T>>& out) {
+        out.resize(queries.size());
+        if (!queries.empty()) {
+            nearestBatch(&queries[0], queries.size(), keys, &out[0], _defaultAccessor);
+        }
+    }
+
+    void nearestBatch(T** queries, size_t numQueries, vector<T*>& keys, Nearest<T>* out) {
+        nearestBatch(queries, numQueries, keys, out, _defaultAccessor);
+    }
+
+    template <typename KEY, typename ACCESSOR>
+    void nearestBatch(vector<T*>& queries, vector<KEY*>& keys, vector<Nearest<KEY>>& out,
+            ACCESSOR& accessor) {
+        out.resize(queries.size());
+        if (!queries.empty()) {
+            nearestBatch(&queries[0], queries.size(), keys, &out[0], accessor);
+        }
+    }
+
+    template <typename KEY, typename ACCESSOR>
+    void nearestBatch(T** queries, size_t numQueries, vector<KEY*>& keys, Nearest<KEY>* out,
+            ACCESSOR& accessor) {
+        typedef typename DistanceBatch<T, DISTANCE>::value_type value_type;
+        T* tile[KEY_TILE];
+        value_type distances[KEY_TILE];
+        value_type nearestDistance[QUERY_TILE];
+        size_t nearestIndex[QUERY_TILE];
+        for (size_t q = 0; q < numQueries; q += QUERY_TILE) {
+            size_t queryCount = numQueries - q < QUERY_TILE ? numQueries - q : QUERY_TILE;
+            for (size_t k = 0; k < keys.size(); k += KEY_TILE) {
+                size_t keyCount = keys.size() - k < KEY_TILE ? keys.size() - k : KEY_TILE;
+                for (size_t i = 0; i < keyCount; ++i) {
+                    tile[i] = accessor(keys[k + i]);
+                }
+                for (size_t j = 0; j < queryCount; ++j) {
+                    _batchDistance(_distance, queries[q + j], tile, keyCount, distances);
+                    size_t best = _comp.best(distances, keyCount);
+                    // ties keep the earlier key, as in nearest()
+                    if (k == 0 || _comp(distances[best], nearestDistance[j])) {
+                        nearestDistance[j] = distances[best];
+                        nearestIndex[j] = k + best;
+                    }
+                }
+            }
+            for (size_t j = 0; j < queryCount; ++j) {
+                size_t index = nearestIndex[j];
+                out[q + j] = {keys[index], index, double(nearestDistance[j])};
+            }
+        }
+    }
+
+    double distance(T* object1, T* object2) {
+        return _distance(object1, object2);
+    }
+
     double squaredDistance(T* object1, T* object2) {
         return _distance.squared(object1, object2);
     }
@@ -76,6 +178,9 @@ public:
     }
 
 private:
+    static const size_t QUERY_TILE = 16;
+    static const size_t KEY_TILE = 32;
+
     /**
      * The default accessor is used for simple key types where the vector of
      * other objects match the object.
@@ -102,6 +207,7 @@ private:
     
     COMPARATOR _comp;
     DISTANCE _distance;
+    DistanceBatch<T, DISTANCE> _batchDistance;
     PROTOTYPE _prototype;
     DefaultAccessor _defaultAccessor;
 };
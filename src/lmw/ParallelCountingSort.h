@@ -0,0 +1,83 @@
+#ifndef PARALLELCOUNTINGSORT_H
+#define	PARALLELCOUNTINGSORT_H
+
+#include "StdIncludes.h"
+#include "tbb/parallel_for.h"
+
+namespace lmw {
+
+/**
+ * A stable counting sort of items by small integer keys that runs in parallel.
+ * It is used to scatter objects into clusters once the nearest cluster for
+ * every object is known.
+ *
+ * The items are split into a fixed number of chunks. Each chunk counts its
+ * keys, a prefix sum gives every chunk its own range of output positions for
+ * each key, and then the chunks scatter their items in parallel. Items with
+ * the same key keep their input order, so the result does not depend on the
+ * number of threads.
+ *
+ * For example,
+ *      // keys[i] is the cluster of objects[i]
+ *      vector<T*> sorted(objects.size());
+ *      vector<size_t> offsets(numClusters + 1);
+ *      ParallelCountingSort::sort(&objects[0], &keys[0], objects.size(),
+ *              numClusters, &sorted[0], &offsets[0]);
+ *      // cluster c holds sorted[offsets[c]] to sorted[offsets[c + 1] - 1]
+ */
+class ParallelCountingSort {
+public:
+    /**
+     * @param items The n items to sort.
+     * @param keys The key of each item, keys[i] < numKeys.
+     * @param out Receives the n sorted items.
+     * @param offsets Receives numKeys + 1 offsets. Items with key k are in
+     *                out[offsets[k]] to out[offsets[k + 1] - 1].
+     */
+    template <typename ITEM, typename KEY>
+    static void sort(const ITEM* items, const KEY* keys, size_t n, size_t numKeys,
+            ITEM* out, size_t* offsets) {
+        // Every chunk has at least as many items as there are keys, so the
+        // counts never take more memory than the items.
+        const size_t maxChunks = 64;
+        size_t numChunks = n / std::max(numKeys, size_t(1024));
+        numChunks = std::max(size_t(1), std::min(maxChunks, numChunks));
+        const size_t chunkSize = (n + numChunks - 1) / numChunks;
+
+        // count the keys in each chunk
+        vector<size_t> counts(numChunks * numKeys, 0);
+        tbb::parallel_for(size_t(0), numChunks, [&](size_t chunk) {
+            size_t* count = &counts[chunk * numKeys];
+            size_t end = std::min(n, (chunk + 1) * chunkSize);
+            for (size_t i = chunk * chunkSize; i < end; ++i) {
+                ++count[keys[i]];
+            }
+        });
+
+        // turn counts into the first output position of each chunk and key
+        size_t total = 0;
+        for (size_t key = 0; key < numKeys; ++key) {
+            offsets[key] = total;
+            for (size_t chunk = 0; chunk < numChunks; ++chunk) {
+                size_t& count = counts[chunk * numKeys + key];
+                size_t start = total;
+                total += count;
+                count = start;
+            }
+        }
+        offsets[numKeys] = total;
+
+        // scatter
+        tbb::parallel_for(size_t(0), numChunks, [&](size_t chunk) {
+            size_t* position = &counts[chunk * numKeys];
+            size_t end = std::min(n, (chunk + 1) * chunkSize);
+            for (size_t i = chunk * chunkSize; i < end; ++i) {
+                out[position[keys[i]]++] = items[i];
+            }
+        });
+    }
+};
+
+} // namespace lmw
+
+#endif	/* PARALLELCOUNTINGSORT_H */
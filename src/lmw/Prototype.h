@@ -27,6 +27,7 @@
 #include "StdIncludes.h"
 #include "BitMapList8.h"
 #include "BitMapList16.h"
+#include "BitSlicedCounter.h"
 #include "SVector.h"
 
 namespace lmw {
@@ -202,6 +203,35 @@ struct meanBitPrototype2 {
 
 };
 
+/**
+ * This version counts bits with a BitSlicedCounter, so the cost depends on the
+ * number of blocks rather than on the number of set bits. It gives the same
+ * result as meanBitPrototype2 and has no limit on the length of bit vectors.
+ */
+struct meanBitPrototypeBitSliced {
+
+    void operator()(SVector<bool> *t1, vector<SVector<bool>*> &objs,
+            vector<int> &weights) const {
+        BitSlicedCounter counter(t1->getNumBlocks());
+        uint64_t halfCount = 0;
+        if (weights.size() != 0) {
+            for (size_t t = 0; t < objs.size(); t++) {
+                counter.add(objs[t]->getData(), weights[t]);
+                halfCount += weights[t];
+            }
+            halfCount /= 2;
+        } else {
+            vector<const block_type*> rows(objs.size());
+            for (size_t t = 0; t < objs.size(); t++) {
+                rows[t] = objs[t]->getData();
+            }
+            counter.add(rows.data(), rows.size());
+            halfCount = objs.size() / 2;
+        }
+        counter.greaterThan(halfCount, t1->getData());
+    }
+};
+
 /**
  * This version uses a look up table to optimise the averaging of bit vectors.
  */
@@ -2,6 +2,7 @@
 #define SVECTOR_H
 
 #include "StdIncludes.h"
+#include "HammingKernels.h"
 
 namespace lmw {
 
@@ -123,12 +124,16 @@ protected:
     size_t _length;
     string _id;
 
+    // Will _data be deleted? False for views onto externally owned blocks.
+    bool _ownsData;
+
 public:
 
     SVector(size_t length) {
         _length = length;
         _numBlocks = _length >> BITS_WS;
         _data = new block_type[_numBlocks];
+        _ownsData = true;
     }
 
     SVector(char *bytes, size_t length) {
@@ -136,39 +141,61 @@ public:
         _length = length;
         _numBlocks = _length >> BITS_WS;
         _data = new block_type[_numBlocks];
+        _ownsData = true;
         memcpy(_data, bytes, numBytes);
     }
 
+    /**
+     * Creates a view onto blocks owned by someone else, for example, a row
+     * of a SignatureMatrix. The blocks are neither copied nor deleted.
+     */
+    SVector(block_type *blocks, size_t length) {
+        _length = length;
+        _numBlocks = _length >> BITS_WS;
+        _data = blocks;
+        _ownsData = false;
+    }
+
+    // Copies always own their data, even when copying a view.
     SVector(SVector<bool> &vec) {
         _length = vec._length;
         _numBlocks = vec._numBlocks;
         _data = new block_type[_numBlocks];
+        _ownsData = true;
 
         // initialise bit vector
-        for (int i = 0; i < _numBlocks; i++) {
-            setBlock(i, vec._data[i]);
-        }
+        memcpy(_data, vec._data, _numBlocks * sizeof (block_type));
     }
 
     SVector(SVector<bool> *vec) {
         _length = vec->_length;
         _numBlocks = vec->_numBlocks;
         _data = new block_type[_numBlocks];
+        _ownsData = true;
 
         // initialise bit vector
-        for (int i = 0; i < _numBlocks; i++) {
-            setBlock(i, vec->_data[i]);
-        }
+        memcpy(_data, vec->_data, _numBlocks * sizeof (block_type));
     }
 
     ~SVector() {
-        delete[] _data;
+        if (_ownsData) {
+            delete[] _data;
+        }
+    }
+
+    bool getOwnsData() {
+        return _ownsData;
     }
 
     void setID(const string& id) {
         _id = id;
     }
 
+    // Reuses the memory of the current ID when it is long enough.
+    void setID(const char* id, size_t length) {
+        _id.assign(id, length);
+    }
+
     const string& getID() {
         return _id;
     }
@@ -185,6 +212,14 @@ public:
         return _data;
     }
 
+    /**
+     * Points a view at different blocks so it can be reused. It must not be
+     * called on a vector that owns its data.
+     */
+    void setData(block_type *blocks) {
+        _data = blocks;
+    }
+
     void setAllBlocks(block_type v) {
         for (size_t i = 0; i < _numBlocks; i++) {
             _data[i] = v;
@@ -231,13 +266,7 @@ public:
     }
 
     int hammingDIstance(SVector<bool> &other) {
-        int count = 0;
-        block_type exclusiveor;
-        for (int i = 0; i < _numBlocks; ++i) {
-            exclusiveor = _data[i] ^ other._data[i];
-            count += popcnt64(exclusiveor);
-        }
-        return count;
+        return HammingKernels::distance(_data, other._data, _numBlocks);
     }
 
     void mean(SVector<bool> *t1, vector<SVector<bool>*> &objs, vector<int> &weights) {
@@ -305,21 +334,11 @@ public:
 #endif
     }
 
+    /**
+     * Uses the fastest kernel supported by the CPU, see HammingKernels.h.
+     */
     static int hammingDistance(SVector<bool> &v1, SVector<bool> &v2) {
-
-        int count = 0;
-        size_t numBlocks = v1.getNumBlocks();
-        block_type *data1, *data2;
-        block_type exor;
-
-        data1 = v1.getData();
-        data2 = v2.getData();
-
-        for (int i = 0; i < numBlocks; ++i) {
-            exor = data1[i] ^ data2[i];
-            count += popcnt64(exor);
-        }
-        return count;
+        return HammingKernels::distance(v1.getData(), v2.getData(), v1.getNumBlocks());
     }
 
 };
@@ -17,6 +17,10 @@ namespace lmw {
  * 
  * VectorStream<T>.free(vector<T*>& data)
  *      frees the memory allocated by the stream
+ *
+ * size_t VectorStream<T>.skip(size_t n)
+ *      moves past the next n vectors without reading them, for example, to
+ *      continue from a checkpoint, and returns how many were skipped
  * 
  * For example,
  *      VectorStream<bool> bvs(idFile, signatureFile);
@@ -103,10 +107,10 @@ public:
             vector->setID(id);
             data->push_back(vector);
 			++_count;
-			if (_maxToRead != -1 && _count > (_maxToRead - 1)) break;
             if (++read == n) {
                 break;
             }
+			if (_maxToRead != -1 && _count > (_maxToRead - 1)) break;
         }
         return read;
     }
@@ -116,6 +120,18 @@ public:
             delete vector;
         }
     }
+
+    size_t skip(size_t n) {
+        string id;
+        size_t skipped = 0;
+        while (skipped < n && (_maxToRead == size_t(-1) || _count < _maxToRead)
+                && getline(_idStream, id)) {
+            ++_count;
+            ++skipped;
+        }
+        _signatureStream.seekg(skipped * _buffer.size(), ios::cur);
+        return skipped;
+    }
     
 private:
     vector<char> _buffer; // temporary buffer for reading a signature
@@ -126,6 +142,82 @@ private:
 	size_t _count; // Number of vectors read so far
 };
 
+/**
+ * Reads dense vectors, such as SVector<float> embeddings, stored one after
+ * another as dimensions values of type T in native byte order.
+ */
+template <typename T>
+class SVectorStream<SVector<T> > {
+public:
+    /**
+     * @param idFile An ASCII file with one object ID per line.
+     * @param vectorFile A file of binary vectors containing as many vectors
+     *                   as there are lines in idFile.
+     * @param dimensions The number of values in a vector.
+     * @param maxToRead The maximum number of vectors to read. A value of -1
+     *                  indicates to read all.
+     */
+    SVectorStream(const string& idFile, const string& vectorFile,
+            const size_t dimensions, const size_t maxToRead = -1) :
+            _idStream(idFile),
+            _vectorStream(vectorFile, ios::in | ios::binary),
+            _dimensions(dimensions),
+            _maxToRead(maxToRead),
+            _count(0) {
+        if (!_idStream) {
+            throw runtime_error("failed to open " + idFile);
+        }
+        if (!_vectorStream) {
+            throw runtime_error("failed to open " + vectorFile);
+        }
+    }
+
+    size_t read(size_t n, vector<SVector<T>*>* data) {
+        string id;
+        size_t read = 0;
+        while (read < n && (_maxToRead == size_t(-1) || _count < _maxToRead)
+                && getline(_idStream, id)) {
+            SVector<T>* vector = new SVector<T>(_dimensions);
+            _vectorStream.read(reinterpret_cast<char*>(vector->begin()),
+                    _dimensions * sizeof(T));
+            if (!_vectorStream) {
+                delete vector;
+                throw runtime_error("vector file is shorter than id file");
+            }
+            vector->setID(id);
+            data->push_back(vector);
+            ++_count;
+            ++read;
+        }
+        return read;
+    }
+
+    void free(vector<SVector<T>*>* data) {
+        for (auto vector : *data) {
+            delete vector;
+        }
+    }
+
+    size_t skip(size_t n) {
+        string id;
+        size_t skipped = 0;
+        while (skipped < n && (_maxToRead == -1 || _count < _maxToRead)
+                && getline(_idStream, id)) {
+            ++_count;
+            ++skipped;
+        }
+        _vectorStream.seekg(skipped * _dimensions * sizeof(T), ios::cur);
+        return skipped;
+    }
+
+private:
+    ifstream _idStream;
+    ifstream _vectorStream;
+    size_t _dimensions; // the number of values in a vector
+    size_t _maxToRead;
+    size_t _count; // Number of vectors read so far
+};
+
 } // namespace lmw
 
 #endif	/* VECTORSTREAM_H */
@@ -0,0 +1,178 @@
+#ifndef SIGNATUREMATRIX_H
+#define	SIGNATUREMATRIX_H
+
+#include "StdIncludes.h"
+#include "SVector.h"
+
+namespace lmw {
+
+/**
+ * A SignatureMatrix stores many bit vector signatures of the same length
+ * back-to-back in a single cache line aligned buffer. This avoids a heap
+ * allocation per signature and keeps neighbouring signatures adjacent in
+ * memory when they are scanned by nearest neighbour search.
+ *
+ * Every row is exposed as a non-owning SVector<bool> view. The views are
+ * stored contiguously in the matrix as well, and getVectors() returns them
+ * in the vector<SVector<bool>*> form expected by KMeans, TSVQ, KTree, EMTree
+ * and StreamingEMTree.
+ *
+ * Rows are padded to a whole number of cache lines so that every signature
+ * starts on a cache line boundary. The padding is always zero.
+ *
+ * The matrix owns the rows and the views. Pointers returned by getVectors()
+ * must not be deleted and are invalid once the matrix is destroyed. Copying a
+ * view, e.g. new SVector<bool>(*view) when seeding centroids, creates an
+ * ordinary vector that owns its data.
+ *
+ * For example,
+ *      SignatureMatrix matrix(numVectors, 4096);
+ *      for (...) {
+ *          SVector<bool>* row = matrix.add();
+ *          memcpy(row->getData(), bytes, 4096 / 8);
+ *      }
+ *      KMeans_t kmeans(k);
+ *      kmeans.cluster(matrix.getVectors());
+ */
+class SignatureMatrix {
+public:
+    static const size_t CACHE_LINE_SIZE = 64;
+
+    /**
+     * @param capacity The maximum number of signatures stored in the matrix.
+     * @param signatureLength The length of a signature in bits.
+     */
+    SignatureMatrix(size_t capacity, size_t signatureLength) :
+            _capacity(capacity), _size(0), _signatureLength(signatureLength) {
+        if (signatureLength % W_SIZE != 0) {
+            throw runtime_error("length is not divisible by 64");
+        }
+        const size_t blocksPerLine = CACHE_LINE_SIZE / sizeof (block_type);
+        _numBlocks = signatureLength / W_SIZE;
+        _stride = ((_numBlocks + blocksPerLine - 1) / blocksPerLine) * blocksPerLine;
+
+        // over allocate so the first row can be aligned to a cache line
+        _buffer = new char[_capacity * _stride * sizeof (block_type) + CACHE_LINE_SIZE];
+        size_t offset = CACHE_LINE_SIZE - (size_t(_buffer) % CACHE_LINE_SIZE);
+        _blocks = reinterpret_cast<block_type*>(_buffer + offset);
+
+        // views are placement constructed as rows are added
+        _views = static_cast<SVector<bool>*>(
+                ::operator new(_capacity * sizeof (SVector<bool>)));
+        _vectors.reserve(_capacity);
+    }
+
+    ~SignatureMatrix() {
+        for (size_t i = 0; i < _size; i++) {
+            _views[i].~SVector<bool>();
+        }
+        ::operator delete(_views);
+        delete[] _buffer;
+    }
+
+    /**
+     * Appends a zeroed row and returns a view of it.
+     */
+    SVector<bool>* add() {
+        if (_size == _capacity) {
+            throw runtime_error("SignatureMatrix is full");
+        }
+        block_type* row = getRow(_size);
+        memset(row, 0, _stride * sizeof (block_type));
+        SVector<bool>* view = new(&_views[_size]) SVector<bool>(row, _signatureLength);
+        _vectors.push_back(view);
+        ++_size;
+        return view;
+    }
+
+    /**
+     * Appends a row copied from signatureLength / 8 bytes.
+     */
+    SVector<bool>* add(const char* bytes) {
+        SVector<bool>* view = add();
+        memcpy(view->getData(), bytes, _signatureLength / 8);
+        return view;
+    }
+
+    /**
+     * Removes the last row if it was added but never filled, for example, when
+     * a read from disk comes up short.
+     */
+    void removeLast() {
+        if (_size > 0) {
+            --_size;
+            _views[_size].~SVector<bool>();
+            _vectors.pop_back();
+        }
+    }
+
+    SVector<bool>* operator[](size_t i) {
+        return get(i);
+    }
+
+    SVector<bool>* get(size_t i) {
+        return &_views[i];
+    }
+
+    /**
+     * The views in row order. This is what gets passed to clustering.
+     */
+    vector<SVector<bool>*>& getVectors() {
+        return _vectors;
+    }
+
+    block_type* getRow(size_t i) {
+        return _blocks + i * _stride;
+    }
+
+    /**
+     * The start of the first row. Row i starts at getData() + i * getStride().
+     */
+    block_type* getData() {
+        return _blocks;
+    }
+
+    // How many blocks there are between the start of consecutive rows.
+    size_t getStride() {
+        return _stride;
+    }
+
+    size_t getNumBlocks() {
+        return _numBlocks;
+    }
+
+    size_t getSignatureLength() {
+        return _signatureLength;
+    }
+
+    size_t size() {
+        return _size;
+    }
+
+    size_t capacity() {
+        return _capacity;
+    }
+
+    bool isEmpty() {
+        return _size == 0;
+    }
+
+private:
+    SignatureMatrix(const SignatureMatrix&) = delete;
+    SignatureMatrix& operator=(const SignatureMatrix&) = delete;
+
+    size_t _capacity;
+    size_t _size;
+    size_t _signatureLength; // in bits
+    size_t _numBlocks; // blocks holding signature bits
+    size_t _stride; // blocks per row including padding
+
+    char* _buffer; // unaligned allocation
+    block_type* _blocks; // cache line aligned rows inside _buffer
+    SVector<bool>* _views; // one view per row
+    vector<SVector<bool>*> _vectors;
+};
+
+} // namespace lmw
+
+#endif	/* SIGNATUREMATRIX_H */
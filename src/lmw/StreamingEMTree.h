@@ -2,11 +2,17 @@
 #define	STREAMINGEMTREE_H
 
 #include "StdIncludes.h"
+#include "BeamSearch.h"
 #include "SVectorStream.h"
+#include "Accumulator.h"
 #include "ClusterVisitor.h"
+#include "FlatTree.h"
 #include "InsertVisitor.h"
+#include "tbb/enumerable_thread_specific.h"
 #include "tbb/mutex.h"
 #include "tbb/pipeline.h"
+#include "tbb/task_scheduler_init.h"
+#include "tbb/tick_count.h"
 
 namespace lmw {
 
@@ -23,16 +29,47 @@ namespace lmw {
  * T is the type of vector stored in the node.
  * 
  * ACCUMULATOR is the the type used for the accumulator vectors. For example,
- * with bit vectors, integer accumulators are used.
+ * with bit vectors, integer accumulators such as SVector<uint32_t> are used,
+ * or a BitSlicedAccumulator, which takes a fraction of the memory.
  * 
  * ACCUMULATORs must support being constructed with the number of dimensions,
  * auto a = ACCUMULATOR(dimensions);
- * They must also support the add operation at a given dimension,
- * a[i] += 1;
+ * and size(). They are otherwise used through AccumulatorOps<ACCUMULATOR>.
  * 
  * OPTIMIZER provides the functions necessary for optimization.
+ * 
+ * UPDATE is the policy that sets the keys from the accumulators in update(),
+ * see Accumulator.h. By default bit vector keys are the majority vote and
+ * other keys, such as SVector<float>, are the mean.
+ * 
+ * Streams must provide vectors of type T. freeze(), write(), checkpoints and
+ * partial results use FlatTree, so they are only available for bit vectors.
+ * 
+ * By default, inserting locks the shared accumulator of the nearest leaf
+ * cluster. With setThreadLocalAccumulators(true) each thread adds into its own
+ * accumulators instead, and they are merged into the shared accumulators when
+ * insert(SVectorStream) finishes, or otherwise before the tree is pruned,
+ * updated or its statistics are read.
+ * This removes all locking from insertion, at the cost of up to one
+ * accumulator per leaf cluster per thread.
+ *
+ * Streams are read in chunks of setReadSize() vectors, with at most
+ * setMaxTokens() chunks in flight. setMemoryBudget() caps the memory used by
+ * the vectors in flight. With setAdaptivePipeline(true) both are adjusted
+ * while streaming: chunks are sized to take about 20ms to process, and there
+ * are up to two chunks in flight per thread, within the memory budget.
+ * getVectorsPerSecond() is the throughput of the last pass over a stream.
+ *
+ * A pass over a large stream can save checkpoints of the keys, accumulators
+ * and the position reached in the stream, and a tree restored from a
+ * checkpoint continues the pass from there. For example,
+ *      size_t offset;
+ *      StreamingEMTree_t tree(checkpointFile, &offset);
+ *      vs.skip(offset);
+ *      tree.insert(vs, 10000000, checkpointFile, offset);
  */
-template <typename T, typename ACCUMULATOR, typename OPTIMIZER>
+template <typename T, typename ACCUMULATOR, typename OPTIMIZER,
+        typename UPDATE = typename DefaultUpdate<T>::type>
 class StreamingEMTree {
 public:
     explicit StreamingEMTree(Node<T>* root) :
@@ -40,85 +77,335 @@ public:
             _root->setOwnsKeys(true);
             deepCopy(root, _root);
     }
+
+    /**
+     * Continues from a snapshot, such as one written by write() and loaded
+     * with FlatTree<T>(file). The leaf keys of the snapshot become the
+     * cluster representatives, with empty accumulators.
+     */
+    explicit StreamingEMTree(FlatTree<T>& flat) :
+        _root(new Node<AccumulatorKey>()) {
+            _root->setOwnsKeys(true);
+            deepCopy(flat, 0, _root);
+    }
+
+    /**
+     * Restores a tree saved by checkpoint(). streamOffset is set to the
+     * number of vectors of the pass that had been inserted.
+     */
+    StreamingEMTree(const string& checkpointFile, size_t* streamOffset) :
+        _root(new Node<AccumulatorKey>()) {
+            _root->setOwnsKeys(true);
+            try {
+                restore(checkpointFile, streamOffset);
+            } catch (...) {
+                delete _root;
+                throw;
+            }
+    }
         
     ~StreamingEMTree() {
+        clearLocalAccumulators();
+        delete _flat;
         delete _root;
     }
 
-    size_t visit(SVectorStream<T>& vs, InsertVisitor<T>& visitor) {
-        size_t totalRead = 0;
+    /**
+     * Takes a FlatTree snapshot of the keys, which insert, visit and search
+     * then use instead of following node pointers. prune() and update()
+     * change the keys, so they take the snapshot again.
+     */
+    void freeze() {
+        freeze(IsBitVector());
+    }
 
-        // setup parallel processing pipeline
-        tbb::parallel_pipeline(_maxtokens,
-                // Input filter reads readsize chunks of vectors in serial
-                tbb::make_filter<void, vector < SVector<bool>*>*>(
-                tbb::filter::serial_out_of_order,
-                inputFilter(vs, totalRead)
-                ) &
-                // Visit filter visits readsize chunks of vectors into streaming EM-tree in parallel
-                tbb::make_filter < vector < SVector<bool>*>*, void>(
-                tbb::filter::parallel,
-                [&] (vector < SVector<bool>*>* data) -> void {
-                    visit(*data, visitor);
-                    vs.free(data);
-                            delete data;
-                }
-        )
-        );
+    /**
+     * Writes the keys, and the object counts and errors of the vectors
+     * inserted since the last update(), to file in the FlatTree format. For
+     * example, writing after each pass and before update() saves the tree
+     * used for the pass with its statistics.
+     */
+    void write(const string& file) {
+        mergeLocalAccumulators();
+        refreshAggregates();
+        Statistics statistics = {this};
+        FlatTree<AccumulatorKey> snapshot(_root, _accessor, statistics);
+        snapshot.write(file);
+    }
 
-        return totalRead;
+    void setThreadLocalAccumulators(bool threadLocalAccumulators) {
+        mergeLocalAccumulators();
+        _threadLocalAccumulators = threadLocalAccumulators;
+    }
+
+    /**
+     * The number of vectors to read at once when processing a stream. In an
+     * adaptive pipeline, it is the size to start with.
+     */
+    void setReadSize(size_t readsize) {
+        _readsize = std::max(readsize, size_t(1));
+    }
+
+    size_t getReadSize() {
+        return _readsize;
+    }
+
+    /**
+     * The maximum number of chunks of vectors in flight. An adaptive
+     * pipeline also has at most two per thread.
+     */
+    void setMaxTokens(size_t maxtokens) {
+        _maxtokens = std::max(maxtokens, size_t(1));
+    }
+
+    size_t getMaxTokens() {
+        return _maxtokens;
+    }
+
+    /**
+     * Limits the chunks in flight so their vectors take at most bytes of
+     * memory, or no limit if bytes is 0. At least one chunk is in flight.
+     */
+    void setMemoryBudget(size_t bytes) {
+        _memoryBudget = bytes;
+    }
+
+    void setAdaptivePipeline(bool adaptive) {
+        _adaptive = adaptive;
+    }
+
+    /**
+     * The number of vectors per second read and processed by the last call
+     * of insert(STREAM) or visit(STREAM).
+     */
+    double getVectorsPerSecond() {
+        return _passSeconds > 0 ? _passVectors / _passSeconds : 0;
+    }
+
+    /**
+     * STREAM is a VectorStream such as SVectorStream or MappedSVectorStream.
+     */
+    template <typename STREAM>
+    size_t visit(STREAM& vs, InsertVisitor<T>& visitor) {
+        _aggregatesValid = false;
+        startPass();
+        return pipeline(vs, size_t(-1), [&] (vector<T*>& data) {
+            visit(data, visitor);
+        });
     }
 
     void visit(ClusterVisitor<T>& visitor) {
+        mergeLocalAccumulators();
+        refreshAggregates();
         visit(NULL, _root, visitor);
     }    
     
     void visit(vector<T*>& data, InsertVisitor<T>& visitor) {
+        _aggregatesValid = false;
         for (T* object : data) {
-            visit(_root, object, visitor);
+            if (_flat) {
+                visitFlat(object, visitor, IsBitVector());
+            } else {
+                visit(_root, object, visitor);
+            }
         }
     }
     
-    size_t insert(SVectorStream<T>& vs) {
-        size_t totalRead = 0;
+    template <typename STREAM>
+    size_t insert(STREAM& vs) {
+        return insert(vs, size_t(-1));
+    }
 
-        // setup parallel processing pipeline
-        tbb::parallel_pipeline(_maxtokens,
-                // Input filter reads readsize chunks of vectors in serial
-                tbb::make_filter<void, vector < SVector<bool>*>*>(
-                tbb::filter::serial_out_of_order,
-                inputFilter(vs, totalRead)
-                ) &
-                // Insert filter inserts readsize chunks of vectors into streaming EM-tree in parallel
-                tbb::make_filter < vector < SVector<bool>*>*, void>(
-                tbb::filter::parallel,
-                [&] (vector < SVector<bool>*>* data) -> void {
-                    insert(*data);
-                    vs.free(data);
-                            delete data;
-                }
-        )
-        );
+    /**
+     * Inserts at most limit vectors from the stream.
+     */
+    template <typename STREAM>
+    size_t insert(STREAM& vs, size_t limit) {
+        startPass();
+        return insertSegment(vs, limit);
+    }
 
+    /**
+     * Inserts the stream like insert(vs), saving a checkpoint() after every
+     * interval vectors and at the end of the stream. The pipeline drains
+     * before each checkpoint, so all vectors read have been inserted. The
+     * recorded offsets start from streamOffset, the number of vectors of the
+     * pass inserted before vs, such as when continuing from a checkpoint.
+     */
+    template <typename STREAM>
+    size_t insert(STREAM& vs, size_t interval, const string& checkpointFile,
+            size_t streamOffset = 0) {
+        size_t totalRead = 0;
+        startPass();
+        for (;;) {
+            size_t read = insertSegment(vs, interval);
+            if (read == 0) {
+                break;
+            }
+            totalRead += read;
+            checkpoint(checkpointFile, streamOffset + totalRead);
+        }
         return totalRead;
     }
+
+    /**
+     * Saves the keys, the accumulators, object counts and errors of the leaf
+     * clusters, the number of updates and streamOffset to checkpointFile. It
+     * starts with the FlatTree file of the keys, as written by write(). The
+     * file is written under a temporary name and then renamed, so a failure
+     * while writing leaves the previous checkpoint intact.
+     */
+    void checkpoint(const string& checkpointFile, size_t streamOffset) {
+        mergeLocalAccumulators();
+        refreshAggregates();
+        vector<AccumulatorKey*> leafKeys;
+        collectLeafKeys(_root, leafKeys);
+
+        CheckpointHeader header;
+        memset(&header, 0, sizeof (header));
+        memcpy(header.magic, CHECKPOINT_MAGIC, sizeof (header.magic));
+        header.version = CHECKPOINT_VERSION;
+        header.valueSize = sizeof (accumulator_value);
+        header.streamOffset = streamOffset;
+        header.updateCount = _updateCount;
+        header.numLeafKeys = leafKeys.size();
+        header.dimensions = leafKeys.empty() ? 0 : leafKeys[0]->accumulator->size();
+
+        string temporary = checkpointFile + ".tmp";
+        std::ofstream out(temporary.c_str(), std::ios::binary | std::ios::trunc);
+        if (!out) {
+            throw runtime_error("failed to open " + temporary);
+        }
+        Statistics statistics = {this};
+        FlatTree<AccumulatorKey> snapshot(_root, _accessor, statistics);
+        snapshot.write(out);
+        out.write(reinterpret_cast<const char*>(&header), sizeof (header));
+        vector<accumulator_value> values(header.dimensions);
+        for (AccumulatorKey* accumulatorKey : leafKeys) {
+            writeLeafKey(out, accumulatorKey, values);
+        }
+        replace(out, temporary, checkpointFile);
+    }
+
+    /**
+     * Saves the accumulators, object counts and errors of the leaf clusters
+     * to partialFile, to be added to a tree with the same keys by
+     * mergeAccumulators(). Only clusters that vectors were inserted into are
+     * saved.
+     *
+     * This allows a pass to be split into shards of the stream, for example,
+     * one per signature file or machine. Every shard is inserted into its own
+     * copy of the tree, such as one restored from the same checkpoint, and
+     * exported. One copy then merges all the partial results before prune()
+     * and update().
+     */
+    void exportAccumulators(const string& partialFile) {
+        mergeLocalAccumulators();
+        vector<AccumulatorKey*> leafKeys;
+        collectLeafKeys(_root, leafKeys);
+
+        PartialHeader header;
+        memset(&header, 0, sizeof (header));
+        memcpy(header.magic, PARTIAL_MAGIC, sizeof (header.magic));
+        header.version = PARTIAL_VERSION;
+        header.valueSize = sizeof (accumulator_value);
+        header.keysHash = keysHash();
+        header.numLeafKeys = leafKeys.size();
+        header.dimensions = leafKeys.empty() ? 0 : leafKeys[0]->accumulator->size();
+        for (AccumulatorKey* accumulatorKey : leafKeys) {
+            if (accumulatorKey->count > 0) {
+                header.numRecords++;
+            }
+        }
+
+        string temporary = partialFile + ".tmp";
+        std::ofstream out(temporary.c_str(), std::ios::binary | std::ios::trunc);
+        if (!out) {
+            throw runtime_error("failed to open " + temporary);
+        }
+        out.write(reinterpret_cast<const char*>(&header), sizeof (header));
+        vector<accumulator_value> values(header.dimensions);
+        for (uint64_t i = 0; i < leafKeys.size(); i++) {
+            if (leafKeys[i]->count > 0) {
+                out.write(reinterpret_cast<const char*>(&i), sizeof (uint64_t));
+                writeLeafKey(out, leafKeys[i], values);
+            }
+        }
+        replace(out, temporary, partialFile);
+    }
+
+    /**
+     * Adds a partial result saved by exportAccumulators() to the leaf
+     * clusters. The keys must be the same as those of the tree it was
+     * exported from.
+     */
+    void mergeAccumulators(const string& partialFile) {
+        mergeLocalAccumulators();
+        vector<AccumulatorKey*> leafKeys;
+        collectLeafKeys(_root, leafKeys);
+
+        std::ifstream in(partialFile.c_str(), std::ios::binary);
+        if (!in) {
+            throw runtime_error("failed to open " + partialFile);
+        }
+        PartialHeader header;
+        in.read(reinterpret_cast<char*>(&header), sizeof (header));
+        if (!in || memcmp(header.magic, PARTIAL_MAGIC, sizeof (header.magic)) != 0
+                || header.version != PARTIAL_VERSION) {
+            throw runtime_error(partialFile + " is not a partial result");
+        }
+        if (header.valueSize != sizeof (accumulator_value)
+                || header.numLeafKeys != leafKeys.size()
+                || header.keysHash != keysHash()
+                || (!leafKeys.empty() && header.dimensions != leafKeys[0]->accumulator->size())) {
+            throw runtime_error(partialFile + " does not match the tree");
+        }
+        vector<accumulator_value> values(header.dimensions);
+        for (uint64_t r = 0; r < header.numRecords; r++) {
+            uint64_t i;
+            in.read(reinterpret_cast<char*>(&i), sizeof (uint64_t));
+            if (!in || i >= leafKeys.size()) {
+                throw runtime_error(partialFile + " is truncated or corrupt");
+            }
+            readLeafKey(in, leafKeys[i], values, true);
+        }
+        if (!in) {
+            throw runtime_error(partialFile + " is truncated");
+        }
+        _aggregatesValid = false;
+    }
+
+    /**
+     * How many times update() has been called, including before the
+     * checkpoint the tree was restored from.
+     */
+    int getUpdateCount() {
+        return _updateCount;
+    }
     
     /**
      * Insert is thread safe. Shared accumulators are locked.
      */
     void insert(vector<T*>& data) {
-        for (T* object : data) {
-            insert(_root, object);
-        }
+        _aggregatesValid = false;
+        insertChunk(data);
     }
     
     int prune() {
-        return prune(_root);
+        mergeLocalAccumulators();
+        refreshAggregates();
+        int pruned = prune(_root);
+        refreeze();
+        return pruned;
     }
     
     void update() {
+        mergeLocalAccumulators();
         update(_root);
         clearAccumulators(_root);
+        _aggregatesValid = false;
+        _updateCount++;
+        refreeze();
     }
     
     int getMaxLevelCount() {
@@ -130,12 +417,47 @@ public:
     }
     
     uint64_t getObjCount() {
-        return objCount(_root);
+        mergeLocalAccumulators();
+        refreshAggregates();
+        return _root->getObjCount();
     }
     
+    /**
+     * Searches the tree with BeamSearch, or the frozen snapshot when there is
+     * one. The data vectors are not stored, so the neighbours are the leaf
+     * cluster representatives. Searches must not run at the same time as
+     * update().
+     */
+    vector<Neighbour<T> > search(T* query, int k, int beamWidth) {
+        vector<Neighbour<T> > neighbours;
+        if (_flat) {
+            searchFlat(query, k, beamWidth, neighbours, IsBitVector());
+        } else {
+            BeamSearch<T, typename OPTIMIZER::distance_type> beamSearch(k, beamWidth);
+            beamSearch.search(_root, query, _accessor, neighbours);
+        }
+        return neighbours;
+    }
+
+    /**
+     * Searches for all queries in parallel.
+     */
+    void search(vector<T*>& queries, int k, int beamWidth,
+            vector<vector<Neighbour<T> > >& neighbours) {
+        if (_flat) {
+            neighbours.resize(queries.size());
+            tbb::parallel_for(size_t(0), queries.size(), [&](size_t i) {
+                neighbours[i] = search(queries[i], k, beamWidth);
+            });
+        } else {
+            BeamSearch<T, typename OPTIMIZER::distance_type> beamSearch(k, beamWidth);
+            beamSearch.search(_root, queries, _accessor, neighbours);
+        }
+    }
+
     double getRMSE() {
-        double RMSE = sumSquaredError(_root);
         uint64_t size = getObjCount();
+        double RMSE = _root->getSumSquaredError();
         RMSE /= size;
         RMSE = sqrt(RMSE);
         return RMSE;
@@ -143,10 +465,47 @@ public:
 
 private:
     typedef tbb::mutex Mutex;
+    typedef AccumulatorOps<ACCUMULATOR> Ops;
+    typedef typename Ops::value_type accumulator_value;
+
+    static constexpr const char* CHECKPOINT_MAGIC = "LMWCKPT";
+    static const uint32_t CHECKPOINT_VERSION = 1;
+
+    /**
+     * Follows the FlatTree in a checkpoint. Then, for every leaf key in
+     * depth-first order, come its uint64_t count, double sum of squared
+     * errors and dimensions accumulator values of valueSize bytes.
+     */
+    struct CheckpointHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t valueSize; // bytes per accumulator value
+        uint64_t streamOffset;
+        uint64_t updateCount;
+        uint64_t numLeafKeys;
+        uint64_t dimensions;
+    };
+
+    static constexpr const char* PARTIAL_MAGIC = "LMWPART";
+    static const uint32_t PARTIAL_VERSION = 1;
+
+    /**
+     * Starts a partial result. numRecords records follow, each the uint64_t
+     * depth-first index of a leaf key and then the same as in a checkpoint.
+     */
+    struct PartialHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t valueSize; // bytes per accumulator value
+        uint64_t keysHash;
+        uint64_t numLeafKeys;
+        uint64_t dimensions;
+        uint64_t numRecords;
+    };
     
     struct AccumulatorKey {
         AccumulatorKey() : key(NULL), sumSquaredError(0), accumulator(NULL),
-                count(0), mutex(NULL) { }
+                count(0), mutex(NULL), index(0) { }
         
         ~AccumulatorKey() {
             if (key) {
@@ -165,13 +524,43 @@ private:
         ACCUMULATOR* accumulator; // accumulator for partially updated key
         uint64_t count; // how many vectors have been added to accumulator
         Mutex* mutex;
+        size_t index; // position of leaf keys in _leafKeys
     };
     
+    /**
+     * A thread's private copy of the accumulator and statistics of a leaf key.
+     */
+    struct LocalAccumulator {
+        explicit LocalAccumulator(size_t dimensions) :
+            accumulator(dimensions), sumSquaredError(0), count(0) {
+            Ops::clear(&accumulator);
+        }
+        
+        ACCUMULATOR accumulator;
+        double sumSquaredError;
+        uint64_t count;
+    };
+    
+    // Local accumulators of a thread indexed by AccumulatorKey::index.
+    typedef vector<LocalAccumulator*> LocalAccumulators;
+    
     struct Accessor {
         T* operator()(AccumulatorKey* accumulatorKey) {
             return accumulatorKey->key;
         }
     };
+
+    /**
+     * The statistics of keys recorded by FlatTree. Aggregates must be fresh.
+     */
+    struct Statistics {
+        StreamingEMTree* tree;
+
+        void operator()(Node<AccumulatorKey>* node, size_t i, uint64_t& count, double& SSE) {
+            count = tree->objCount(node, i);
+            SSE = tree->sumSquaredError(node, i);
+        }
+    };
        
     void visit(T* parentKey, Node<AccumulatorKey>* node, ClusterVisitor<T>& visitor, int level = 1) {
         for (size_t i = 0; i < node->size(); i++) {
@@ -205,24 +594,200 @@ private:
         }
     }    
     
-    void insert(Node<AccumulatorKey>* node, T* object) {
-        auto nearest = nearestKey(object, node);
-        if (node->isLeaf()) {
-            // update stats and accumulators
+    /**
+     * Only bit vector trees are frozen, so the FlatTree versions of insert,
+     * visit and search are only compiled for them. IsBitVector selects them.
+     */
+    typedef typename std::is_same<T, SVector<bool> >::type IsBitVector;
+
+    void freeze(std::true_type) {
+        mergeLocalAccumulators();
+        refreshAggregates();
+        Statistics statistics = {this};
+        delete _flat;
+        _flat = new FlatTree<AccumulatorKey>(_root, _accessor, statistics);
+    }
+
+    void freeze(std::false_type) {
+        throw runtime_error("only trees of bit vectors can be frozen");
+    }
+
+    void visitFlat(T*, InsertVisitor<T>&, std::false_type) {
+    }
+
+    void insertFlat(vector<T*>&, std::false_type) {
+    }
+
+    void searchFlat(T*, int, int, vector<Neighbour<T> >&, std::false_type) {
+    }
+
+    void searchFlat(T* query, int k, int beamWidth, vector<Neighbour<T> >& neighbours,
+            std::true_type) {
+        vector<Neighbour<AccumulatorKey> > flatNeighbours;
+        _flat->search(query, k, beamWidth, flatNeighbours);
+        for (Neighbour<AccumulatorKey>& n : flatNeighbours) {
+            neighbours.push_back({n.object->key, n.distance});
+        }
+    }
+
+    /**
+     * The same as visit(_root, object, visitor) using the FlatTree.
+     */
+    void visitFlat(T* object, InsertVisitor<T>& visitor, std::true_type) {
+        uint32_t node = 0;
+        for (int level = 1;; ++level) {
+            auto nearest = _flat->nearestKey(object, node);
             auto accumulatorKey = nearest.key;
-            Mutex::scoped_lock lock(*accumulatorKey->mutex);
-            T* key = accumulatorKey->key;
-            accumulatorKey->sumSquaredError += _optimizer.squaredDistance(object, key);
-            ACCUMULATOR* accumulator = accumulatorKey->accumulator;
-            for (size_t i = 0; i < accumulator->size(); i++) {
-                (*accumulator)[i] += (*object)[i];
+            visitor.accept(level, object, accumulatorKey->key, nearest.distance);
+            auto& flatNode = _flat->getNode(node);
+            if (flatNode.isLeaf()) {
+                // update stats but not accumulators
+                Mutex::scoped_lock lock(*accumulatorKey->mutex);
+                accumulatorKey->sumSquaredError +=
+                        _optimizer.squaredDistance(object, accumulatorKey->key);
+                accumulatorKey->count++;
+                return;
             }
-            accumulatorKey->count++;
+            node = _flat->getChild(flatNode, nearest.index);
+        }
+    }
+
+    void insertChunk(vector<T*>& data) {
+        if (_flat) {
+            insertFlat(data, IsBitVector());
         } else {
-            insert(node->getChild(nearest.index), object);
+            insert(_root, data);
+        }
+    }
+
+    /**
+     * Inserts a chunk of vectors using the FlatTree. The vectors are grouped
+     * by their nearest leaf key, so each accumulator is locked once.
+     */
+    void insertFlat(vector<T*>& data, std::true_type) {
+        if (data.empty()) {
+            return;
+        }
+        vector<Nearest<AccumulatorKey> > nearest;
+        _flat->nearestLeafKeys(data, nearest);
+
+        // group the vectors by their nearest leaf key, sorting only the
+        // chunk so the cost does not depend on the size of the tree
+        vector<uint32_t> order(data.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return nearest[a].index < nearest[b].index;
+        });
+        vector<T*> members(data.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            members[i] = data[order[i]];
+        }
+        for (size_t first = 0; first < order.size();) {
+            size_t last = first + 1;
+            while (last < order.size() && nearest[order[last]].index == nearest[order[first]].index) {
+                ++last;
+            }
+            AccumulatorKey* accumulatorKey = nearest[order[first]].key;
+            if (_threadLocalAccumulators) {
+                addLocal(accumulatorKey, &members[first], last - first);
+            } else {
+                add(accumulatorKey, &members[first], last - first);
+            }
+            first = last;
         }
     }
 
+    /**
+     * Inserts a chunk of vectors one level at a time. Nearest keys for the
+     * whole chunk are found in a single batch. At the leaves each accumulator
+     * is locked once for all the vectors nearest to it.
+     */
+    void insert(Node<AccumulatorKey>* node, vector<T*>& data) {
+        if (data.empty()) {
+            return;
+        }
+        vector<Nearest<AccumulatorKey>> nearest;
+        _optimizer.nearestBatch(data, node->getKeys(), nearest, _accessor);
+        vector<vector<T*>> partitions(node->size());
+        for (size_t i = 0; i < data.size(); ++i) {
+            partitions[nearest[i].index].push_back(data[i]);
+        }
+        for (size_t i = 0; i < partitions.size(); ++i) {
+            if (partitions[i].empty()) {
+                continue;
+            }
+            if (node->isLeaf()) {
+                if (_threadLocalAccumulators) {
+                    addLocal(node->getKey(i), &partitions[i][0], partitions[i].size());
+                } else {
+                    add(node->getKey(i), &partitions[i][0], partitions[i].size());
+                }
+            } else {
+                insert(node->getChild(i), partitions[i]);
+            }
+        }
+    }
+
+    void add(AccumulatorKey* accumulatorKey, T** objects, size_t n) {
+        Mutex::scoped_lock lock(*accumulatorKey->mutex);
+        T* key = accumulatorKey->key;
+        for (size_t i = 0; i < n; ++i) {
+            accumulatorKey->sumSquaredError += _optimizer.squaredDistance(objects[i], key);
+        }
+        Ops::add(accumulatorKey->accumulator, objects, n);
+        accumulatorKey->count += n;
+    }
+    
+    /**
+     * Adds objects to this thread's accumulator for accumulatorKey. No locks
+     * are taken. The accumulator is allocated the first time this thread
+     * reaches the key.
+     */
+    void addLocal(AccumulatorKey* accumulatorKey, T** objects, size_t n) {
+        LocalAccumulators& locals = _localAccumulators.local();
+        if (locals.empty()) {
+            locals.resize(_leafKeys.size(), NULL);
+        }
+        LocalAccumulator*& local = locals[accumulatorKey->index];
+        if (!local) {
+            local = new LocalAccumulator(accumulatorKey->key->size());
+        }
+        T* key = accumulatorKey->key;
+        for (size_t i = 0; i < n; ++i) {
+            local->sumSquaredError += _optimizer.squaredDistance(objects[i], key);
+        }
+        Ops::add(&local->accumulator, objects, n);
+        local->count += n;
+    }
+    
+    /**
+     * Adds thread local accumulators into the shared accumulators and frees
+     * them. It must not run concurrently with insert.
+     */
+    void mergeLocalAccumulators() {
+        for (LocalAccumulators& locals : _localAccumulators) {
+            for (size_t i = 0; i < locals.size(); i++) {
+                LocalAccumulator* local = locals[i];
+                if (local) {
+                    AccumulatorKey* accumulatorKey = _leafKeys[i];
+                    Ops::merge(accumulatorKey->accumulator, &local->accumulator);
+                    accumulatorKey->sumSquaredError += local->sumSquaredError;
+                    accumulatorKey->count += local->count;
+                }
+            }
+        }
+        clearLocalAccumulators();
+    }
+    
+    void clearLocalAccumulators() {
+        for (LocalAccumulators& locals : _localAccumulators) {
+            Utils::purge(locals);
+        }
+        _localAccumulators.clear();
+    }
+    
     int prune(Node<AccumulatorKey>* node) {
         int pruned = 0;
         for (int i = 0; i < node->size(); i++) {
@@ -241,10 +806,7 @@ private:
             uint64_t* totalCount) {
         if (node->isLeaf()) {
             for (auto accumulatorKey : node->getKeys()) {
-                auto accumulator = accumulatorKey->accumulator;
-                for (size_t i = 0; i < accumulator->size(); i++) {
-                    (*total)[i] += (*accumulator)[i];
-                }
+                Ops::merge(total, accumulatorKey->accumulator);
                 *totalCount += accumulatorKey->count;
             }
         } else {
@@ -254,19 +816,10 @@ private:
         }
     }
     
-    /**
-     * TODO(cdevries): Make it work for something other than bitvectors. It needs
-     * to be parameterized, for example, with float vectors, a mean is taken.
-     */
-    static void updatePrototypeFromAccumulator(T* key, ACCUMULATOR* accumulator,
+    void updatePrototypeFromAccumulator(T* key, ACCUMULATOR* accumulator,
             uint64_t count) {
         // calculate new key based on accumulator
-        key->setAllBlocks(0);
-        for (size_t i = 0; i < key->size(); i++) {
-            if ((*accumulator)[i] > (count / 2)) {
-                key->set(i);
-            }
-        }
+        _update(key, accumulator, count);
     }
     
     void update(Node<AccumulatorKey>* node) {
@@ -284,7 +837,7 @@ private:
                 T* key = accumulatorKey->key;
                 auto child = node->getChild(i);
                 ACCUMULATOR total(dimensions);
-                total.setAll(0);
+                Ops::clear(&total);
                 uint64_t totalCount = 0;
                 gatherAccumulators(child, &total, &totalCount);
                 updatePrototypeFromAccumulator(key, &total, totalCount);
@@ -299,7 +852,7 @@ private:
         if (node->isLeaf()) {
             for (auto accumulatorKey : node->getKeys()) {
                 accumulatorKey->sumSquaredError = 0;
-                accumulatorKey->accumulator->setAll(0);
+                Ops::clear(accumulatorKey->accumulator);
                 accumulatorKey->count = 0;
             }
         } else {
@@ -316,14 +869,11 @@ private:
                 auto key = src->getKey(i);
                 auto child = src->getChild(i);
                 auto accumulatorKey = new AccumulatorKey();
-                accumulatorKey->key = new T(key);
+                accumulatorKey->key = new T(*key);
                 if (child->isLeaf()) {
                     // Do not copy leaves of original tree and setup
                     // accumulators for the lowest level cluster means.
-                    accumulatorKey->accumulator = new ACCUMULATOR(dimensions);
-                    accumulatorKey->accumulator->setAll(0);
-                    accumulatorKey->mutex = new Mutex();
-                    dst->add(accumulatorKey);
+                    addLeafKey(accumulatorKey, dimensions, dst);
                 } else {
                     auto newChild = new Node<AccumulatorKey>();
                     newChild->setOwnsKeys(true);
@@ -334,11 +884,301 @@ private:
         }
     }
 
-    std::function<vector<SVector<bool>*>*(tbb::flow_control&)> inputFilter(
-            SVectorStream<T>& vs, size_t& totalRead) {
-        return ([&] (tbb::flow_control & fc) -> vector < SVector<bool>*>* {
+    void deepCopy(FlatTree<T>& src, uint32_t node, Node<AccumulatorKey>* dst) {
+        auto& flatNode = src.getNode(node);
+        for (uint32_t row = flatNode.firstKey; row < flatNode.firstKey + flatNode.size; row++) {
+            auto accumulatorKey = new AccumulatorKey();
+            accumulatorKey->key = new T(src.getKey(row));
+            if (flatNode.isLeaf()) {
+                addLeafKey(accumulatorKey, src.getSignatureLength(), dst);
+            } else {
+                auto newChild = new Node<AccumulatorKey>();
+                newChild->setOwnsKeys(true);
+                deepCopy(src, src.getChild(flatNode, row), newChild);
+                dst->add(accumulatorKey, newChild);
+            }
+        }
+    }
+
+    /**
+     * Rebuilds the tree from the FlatTree at the start of the file, in which
+     * the leaf keys are added depth-first, so _leafKeys are in the order of
+     * the accumulators that follow it.
+     */
+    void restore(const string& checkpointFile, size_t* streamOffset) {
+        FlatTree<T> flat(checkpointFile);
+        deepCopy(flat, 0, _root);
+
+        std::ifstream in(checkpointFile.c_str(), std::ios::binary);
+        in.seekg(flat.getFileSize());
+        CheckpointHeader header;
+        in.read(reinterpret_cast<char*>(&header), sizeof (header));
+        if (!in || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof (header.magic)) != 0
+                || header.version != CHECKPOINT_VERSION) {
+            throw runtime_error(checkpointFile + " is not a checkpoint");
+        }
+        if (header.valueSize != sizeof (accumulator_value)
+                || header.numLeafKeys != _leafKeys.size()
+                || (!_leafKeys.empty() && header.dimensions != _leafKeys[0]->accumulator->size())) {
+            throw runtime_error(checkpointFile + " does not match the tree");
+        }
+        vector<accumulator_value> values(header.dimensions);
+        for (AccumulatorKey* accumulatorKey : _leafKeys) {
+            readLeafKey(in, accumulatorKey, values, false);
+        }
+        if (!in) {
+            throw runtime_error(checkpointFile + " is truncated");
+        }
+        *streamOffset = header.streamOffset;
+        _updateCount = header.updateCount;
+    }
+
+    /**
+     * Writes the count, sum of squared errors and accumulator of a leaf key.
+     * values is a buffer of the accumulator's dimensions.
+     */
+    void writeLeafKey(std::ostream& out, AccumulatorKey* accumulatorKey,
+            vector<accumulator_value>& values) {
+        out.write(reinterpret_cast<const char*>(&accumulatorKey->count), sizeof (uint64_t));
+        out.write(reinterpret_cast<const char*>(&accumulatorKey->sumSquaredError), sizeof (double));
+        if (!values.empty()) {
+            Ops::getValues(accumulatorKey->accumulator, &values[0]);
+            out.write(reinterpret_cast<const char*>(&values[0]),
+                    values.size() * sizeof (accumulator_value));
+        }
+    }
+
+    /**
+     * Reads what writeLeafKey() wrote, and adds it to the leaf key or
+     * replaces its values.
+     */
+    void readLeafKey(std::istream& in, AccumulatorKey* accumulatorKey,
+            vector<accumulator_value>& values, bool add) {
+        uint64_t count = 0;
+        double sumSquaredError = 0;
+        in.read(reinterpret_cast<char*>(&count), sizeof (uint64_t));
+        in.read(reinterpret_cast<char*>(&sumSquaredError), sizeof (double));
+        if (!values.empty()) {
+            in.read(reinterpret_cast<char*>(&values[0]),
+                    values.size() * sizeof (accumulator_value));
+        }
+        if (!in) {
+            return;
+        }
+        if (add) {
+            accumulatorKey->count += count;
+            accumulatorKey->sumSquaredError += sumSquaredError;
+            if (!values.empty()) {
+                Ops::addValues(accumulatorKey->accumulator, &values[0]);
+            }
+        } else {
+            accumulatorKey->count = count;
+            accumulatorKey->sumSquaredError = sumSquaredError;
+            if (!values.empty()) {
+                Ops::setValues(accumulatorKey->accumulator, &values[0]);
+            }
+        }
+    }
+
+    /**
+     * Closes out and renames temporary to file.
+     */
+    static void replace(std::ofstream& out, const string& temporary, const string& file) {
+        out.close();
+        if (!out) {
+            throw runtime_error("failed to write " + temporary);
+        }
+        if (rename(temporary.c_str(), file.c_str()) != 0) {
+            throw runtime_error("failed to rename " + temporary);
+        }
+    }
+
+    /**
+     * A FNV-1a hash of the shape of the tree and all keys in depth-first
+     * order, which identifies the tree a partial result belongs to.
+     */
+    uint64_t keysHash() {
+        uint64_t hash = 14695981039346656037ULL;
+        keysHash(_root, hash);
+        return hash;
+    }
+
+    void keysHash(Node<AccumulatorKey>* node, uint64_t& hash) {
+        hashBytes(hash, uint64_t(node->size()));
+        hashBytes(hash, node->isLeaf());
+        for (size_t i = 0; i < size_t(node->size()); i++) {
+            SVector<bool>* key = _accessor(node->getKey(i));
+            for (size_t j = 0; j < key->getNumBlocks(); j++) {
+                hashBytes(hash, key->getData()[j]);
+            }
+            if (!node->isLeaf()) {
+                keysHash(node->getChild(i), hash);
+            }
+        }
+    }
+
+    template <typename VALUE>
+    static void hashBytes(uint64_t& hash, VALUE value) {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&value);
+        for (size_t i = 0; i < sizeof (VALUE); i++) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ULL;
+        }
+    }
+
+    void collectLeafKeys(Node<AccumulatorKey>* node, vector<AccumulatorKey*>& leafKeys) {
+        if (node->isLeaf()) {
+            vector<AccumulatorKey*>& keys = node->getKeys();
+            leafKeys.insert(leafKeys.end(), keys.begin(), keys.end());
+        } else {
+            for (auto child : node->getChildren()) {
+                collectLeafKeys(child, leafKeys);
+            }
+        }
+    }
+
+    /**
+     * Sets up the accumulator of a lowest level cluster mean.
+     */
+    void addLeafKey(AccumulatorKey* accumulatorKey, size_t dimensions,
+            Node<AccumulatorKey>* dst) {
+        accumulatorKey->accumulator = new ACCUMULATOR(dimensions);
+        Ops::clear(accumulatorKey->accumulator);
+        accumulatorKey->mutex = new Mutex();
+        accumulatorKey->index = _leafKeys.size();
+        _leafKeys.push_back(accumulatorKey);
+        dst->add(accumulatorKey);
+    }
+
+    template <typename STREAM>
+    size_t insertSegment(STREAM& vs, size_t limit) {
+        _aggregatesValid = false;
+        size_t read = pipeline(vs, limit, [this] (vector<T*>& data) {
+            insertChunk(data);
+        });
+        mergeLocalAccumulators();
+        return read;
+    }
+
+    void startPass() {
+        _passVectors = 0;
+        _passSeconds = 0;
+    }
+
+    /**
+     * Streams at most limit vectors through process(vector<T*>&), which is
+     * called for chunks of vectors in parallel, and returns the number read.
+     * An adaptive pipeline runs in rounds of ADAPTIVE_ROUND chunks per token
+     * and resizes itself after each round from the time spent processing.
+     */
+    template <typename STREAM, typename PROCESS>
+    size_t pipeline(STREAM& vs, size_t limit, PROCESS process) {
+        const size_t ADAPTIVE_ROUND = 16;
+        tbb::tick_count start = tbb::tick_count::now();
+        size_t totalRead = 0;
+        while (totalRead < limit) {
+            size_t tokens = pipelineTokens();
+            size_t roundLimit = limit - totalRead;
+            if (_adaptive) {
+                roundLimit = std::min(roundLimit, _readsize * tokens * ADAPTIVE_ROUND);
+            }
+            size_t roundRead = 0;
+            tbb::enumerable_thread_specific<double> busy(0.0);
+
+            // setup parallel processing pipeline
+            tbb::parallel_pipeline(tokens,
+                    // Input filter reads readsize chunks of vectors in serial
+                    tbb::make_filter<void, vector<T*>*>(
+                    tbb::filter::serial_out_of_order,
+                    inputFilter(vs, roundRead, roundLimit)
+                    ) &
+                    // Processes readsize chunks of vectors in parallel
+                    tbb::make_filter < vector<T*>*, void>(
+                    tbb::filter::parallel,
+                    [&] (vector<T*>* data) -> void {
+                        tbb::tick_count chunkStart = tbb::tick_count::now();
+                        process(*data);
+                        busy.local() += (tbb::tick_count::now() - chunkStart).seconds();
+                        vs.free(data);
+                                delete data;
+                    }
+            )
+            );
+
+            totalRead += roundRead;
+            if (!_adaptive || roundRead < roundLimit) {
+                break;
+            }
+            adaptPipeline(roundRead, busy.combine(std::plus<double>()));
+        }
+        _passVectors += totalRead;
+        _passSeconds += (tbb::tick_count::now() - start).seconds();
+        return totalRead;
+    }
+
+    /**
+     * Sizes chunks to take about _targetChunkSeconds to process, changing
+     * the size at most twofold per round.
+     */
+    void adaptPipeline(size_t vectors, double busySeconds) {
+        const size_t minReadsize = 16;
+        size_t readsize = _readsize * 2;
+        if (busySeconds > 0) {
+            readsize = size_t(_targetChunkSeconds * vectors / busySeconds);
+        }
+        readsize = std::min(std::max(readsize, _readsize / 2), _readsize * 2);
+        _readsize = std::max(readsize, minReadsize);
+    }
+
+    /**
+     * The number of chunks in flight, at most _maxtokens and two per thread
+     * in an adaptive pipeline, reduced to fit the memory budget. An adaptive
+     * pipeline makes its chunks smaller instead, while each thread can have
+     * one.
+     */
+    size_t pipelineTokens() {
+        size_t threads = tbb::task_scheduler_init::default_num_threads();
+        size_t tokens = _adaptive ? std::min(_maxtokens, 2 * threads) : _maxtokens;
+        if (_memoryBudget > 0) {
+            size_t inFlight = std::max(_memoryBudget / vectorBytes(), size_t(1));
+            if (_adaptive) {
+                _readsize = std::max(std::min(_readsize, inFlight / threads), size_t(1));
+            }
+            tokens = std::min(tokens, inFlight / _readsize);
+        }
+        return std::max(tokens, size_t(1));
+    }
+
+    /**
+     * The memory taken by a vector read from a stream, estimated from the
+     * keys of the tree.
+     */
+    size_t vectorBytes() {
+        if (_root->isEmpty()) {
+            return sizeof (T) + sizeof (T*);
+        }
+        return vectorBytes(_accessor(_root->getKey(0))) + sizeof (T*);
+    }
+
+    static size_t vectorBytes(SVector<bool>* vector) {
+        return sizeof (*vector) + vector->getNumBlocks() * sizeof (block_type);
+    }
+
+    template <typename VECTOR>
+    static size_t vectorBytes(VECTOR* vector) {
+        return sizeof (*vector) + vector->size() * sizeof (*vector->begin());
+    }
+
+    template <typename STREAM>
+    std::function<vector<T*>*(tbb::flow_control&)> inputFilter(
+            STREAM& vs, size_t& totalRead, size_t limit = size_t(-1)) {
+        return ([&vs, &totalRead, limit, this] (tbb::flow_control & fc) -> vector<T*>* {
+            if (totalRead == limit) {
+                fc.stop();
+                return NULL;
+            }
             auto data = new vector<T*>;
-            size_t read = vs.read(_readsize, data);
+            size_t read = vs.read(std::min(_readsize, limit - totalRead), data);
             if (read == 0) {
                 delete data;
                 fc.stop();
@@ -349,56 +1189,67 @@ private:
         });
     }
     
-    double sumSquaredError(Node<AccumulatorKey>* node, size_t i) {
-        if (node->isLeaf()) {
-            return node->getKey(i)->sumSquaredError;
-        } else {
-            return sumSquaredError(node->getChild(i));
+    /**
+     * Rebuilds the FlatTree after the keys have changed, if there is one.
+     */
+    void refreeze() {
+        if (_flat) {
+            freeze();
         }
     }
-    
-    double sumSquaredError(Node<AccumulatorKey>* node) {
+
+    /**
+     * Recalculates the object count and sum of squared errors cached in
+     * every node from the leaf accumulators, if they have changed since the
+     * last refresh. Local accumulators must be merged first.
+     */
+    void refreshAggregates() {
+        if (!_aggregatesValid) {
+            refreshAggregates(_root);
+            _aggregatesValid = true;
+        }
+    }
+
+    void refreshAggregates(Node<AccumulatorKey>* node) {
+        uint64_t count = 0;
+        double SSE = 0;
         if (node->isLeaf()) {
-            double localSum = 0;
             for (auto key : node->getKeys()) {
-                localSum += key->sumSquaredError;
+                count += key->count;
+                SSE += key->sumSquaredError;
             }
-            return localSum;
         } else {
-            double localSum = 0;
             for (auto child : node->getChildren()) {
-                localSum += sumSquaredError(child);
+                refreshAggregates(child);
+                count += child->getObjCount();
+                SSE += child->getSumSquaredError();
             }
-            return localSum;
-        }        
+        }
+        node->setObjCount(count);
+        node->setSumSquaredError(SSE);
     }
-    
+
     /**
-     * Object count for cluster i in node.
+     * Sum of squared errors for cluster i in node. Aggregates must be fresh.
      */
-    uint64_t objCount(Node<AccumulatorKey>* node, size_t i) {
+    double sumSquaredError(Node<AccumulatorKey>* node, size_t i) {
         if (node->isLeaf()) {
-            return node->getKey(i)->count;
+            return node->getKey(i)->sumSquaredError;
         } else {
-            return objCount(node->getChild(i));
+            return node->getChild(i)->getSumSquaredError();
         }
     }
     
-    uint64_t objCount(Node<AccumulatorKey>* node) {
+    /**
+     * Object count for cluster i in node. Aggregates must be fresh.
+     */
+    uint64_t objCount(Node<AccumulatorKey>* node, size_t i) {
         if (node->isLeaf()) {
-            uint64_t localCount = 0;
-            for (auto key : node->getKeys()) {
-                localCount += key->count;
-            }
-            return localCount;
+            return node->getKey(i)->count;
         } else {
-            uint64_t localCount = 0;
-            for (auto child : node->getChildren()) {
-                localCount += objCount(child);
-            }
-            return localCount;
+            return node->getChild(i)->getObjCount();
         }
-    }    
+    }
 
     int maxLevelCount(Node<AccumulatorKey>* current) {
         if (current->isLeaf()) {
@@ -426,13 +1277,43 @@ private:
 
     Node<AccumulatorKey>* _root;
     OPTIMIZER _optimizer;
+    UPDATE _update;
     Accessor _accessor;
     
+    // All leaf keys in the order they were created. Entries for keys removed
+    // by prune() are left dangling and never accessed again.
+    vector<AccumulatorKey*> _leafKeys;
+    
+    bool _threadLocalAccumulators = false;
+    
+    // Snapshot of the keys taken by freeze(), or NULL
+    FlatTree<AccumulatorKey>* _flat = NULL;
+
+    // Are the object counts and errors cached in the nodes up to date?
+    bool _aggregatesValid = false;
+    tbb::enumerable_thread_specific<LocalAccumulators> _localAccumulators;
+    
     // How mamny vectors to read at once when processing a stream.
-    int _readsize = 1000;
+    size_t _readsize = 1000;
     
     // The maximum number of readsize vector chunks that can be loaded at once.
-    int _maxtokens = 1024;
+    size_t _maxtokens = 1024;
+
+    // The most memory vectors in flight may take, or 0 for no limit
+    size_t _memoryBudget = 0;
+
+    // Are _readsize and _maxtokens adjusted while streaming?
+    bool _adaptive = false;
+
+    // The time processing a chunk should take in an adaptive pipeline
+    double _targetChunkSeconds = 0.02;
+
+    // Vectors streamed and time taken by the last pass
+    size_t _passVectors = 0;
+    double _passSeconds = 0;
+
+    // The number of calls to update(), restored from checkpoints
+    int _updateCount = 0;
 };
  
 } // namespace lmw
@@ -3,6 +3,7 @@
 
 #include "StdIncludes.h"
 
+#include "BeamSearch.h"
 #include "Node.h"
 
 #include "tbb/task.h"
@@ -25,12 +26,19 @@ public:
         return _root;
     }
 
+    /**
+     * Split nodes with mini-batch k-means, see KMeans::setMiniBatch().
+     */
+    void setMiniBatch(size_t batchSize) {
+        _miniBatchSize = batchSize;
+    }
+
     int getClusterCount() {
         return clusterCount(_root);
     }
 
     uint64_t getObjCount() {
-        return objCount(_root);
+        return _root->getObjCount();
     }
 
     int getLevelCount() {
@@ -58,8 +66,30 @@ public:
         _root->addAll(data);
         
         // spawn parallel tasks for recursion when building the tree
-        TSVQTask *t = new(tbb::task::allocate_root()) TSVQTask(_root, _m, _depth, _maxIters);
+        TSVQTask *t = new(tbb::task::allocate_root()) TSVQTask(_root, _m, _depth, _maxIters,
+                _miniBatchSize);
         tbb::task::spawn_root_and_wait(*t);
+        _root->refreshAggregates();
+    }
+
+    /**
+     * Searches the tree built by cluster() with BeamSearch. The neighbours are
+     * the clustered vectors.
+     */
+    vector<Neighbour<T> > search(T* query, int k, int beamWidth) {
+        BeamSearch<T, DISTANCE> beamSearch(k, beamWidth);
+        vector<Neighbour<T> > neighbours;
+        beamSearch.search(_root, query, neighbours);
+        return neighbours;
+    }
+
+    /**
+     * Searches for all queries in parallel.
+     */
+    void search(vector<T*>& queries, int k, int beamWidth,
+            vector<vector<Neighbour<T> > >& neighbours) {
+        BeamSearch<T, DISTANCE> beamSearch(k, beamWidth);
+        beamSearch.search(_root, queries, neighbours);
     }
 
     double getRMSE() {
@@ -71,8 +101,10 @@ private:
     class TSVQTask : public tbb::task {
     public:
 
-        TSVQTask(Node<T>* current, int order, int depth, int maxiters) :
-            _current(current), _m(order), _treeDepth(depth), _maxIters(maxiters) {
+        TSVQTask(Node<T>* current, int order, int depth, int maxiters,
+                size_t miniBatchSize) :
+            _current(current), _m(order), _treeDepth(depth), _maxIters(maxiters),
+            _miniBatchSize(miniBatchSize) {
         }
 
         ~TSVQTask() {
@@ -82,6 +114,7 @@ private:
             // split using clustering algorithm
             CLUSTERER* clusterer = new CLUSTERER(_m);
             clusterer->setMaxIters(_maxIters);
+            clusterer->setMiniBatch(_miniBatchSize);
             vector<Cluster<T>*> clusters = clusterer->cluster(_current->getKeys());            
             
             // assign clusters to tree
@@ -105,7 +138,8 @@ private:
             vector<TSVQTask*> childTasks;
             // Create TBB tasks
             for (Node<T>* n : _current->getChildren()) {
-                TSVQTask *t = new(allocate_child()) TSVQTask(n, _m, _treeDepth - 1, _maxIters);
+                TSVQTask *t = new(allocate_child()) TSVQTask(n, _m, _treeDepth - 1, _maxIters,
+                        _miniBatchSize);
                 childTasks.push_back(t);
             }
             // Set ref count to number of tasks + 1
@@ -138,6 +172,9 @@ private:
         // The maximum number of iterations
         int _maxIters;
 
+        // Vectors per batch for mini-batch k-means, 0 if not used
+        size_t _miniBatchSize;
+
         // The root of the tree.
         Node<T> *_current;
     };
@@ -150,7 +187,11 @@ private:
         return RMSE;
     }
 
+    // The result is cached in child until the tree is clustered again.
     double sumSquaredError(T* parentKey, Node<T> *child) {
+        if (child->hasSumSquaredError()) {
+            return child->getSumSquaredError();
+        }
 
         double distance = 0.0;
         double dis;
@@ -171,23 +212,10 @@ private:
             }
         }
 
+        child->setSumSquaredError(distance);
         return distance;
     }
 
-    uint64_t objCount(Node<T>* current) {
-        if (current->isLeaf()) {
-            return current->size();
-        } else {
-            uint64_t localCount = 0;
-            vector<Node<T>*>& children = current->getChildren();
-            for (Node<T> *child : children) {
-                localCount += objCount(child);
-
-            }
-            return localCount;
-        }
-    }
-
     int clusterCount(Node<T>* current) {
         if (current->isLeaf()) {
             if (current->isEmpty()) {
@@ -257,6 +285,9 @@ private:
 
     // The maximum number of iterations
     int _maxIters;
+
+    // Vectors per batch for mini-batch k-means, 0 if not used
+    size_t _miniBatchSize = 0;
     
     DISTANCE _distance;
 };